@@ -0,0 +1,523 @@
+/*
+ * Copyright (c) 2014 Alexander Bluhm <bluhm@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <event.h>
+#include <limits.h>
+#include <paths.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+/*
+ * Size of the objects that client and server allocate per flow,
+ * an event and two socket addresses.
+ */
+struct bench_item {
+	struct event		 bi_event;
+	struct sockaddr_storage	 bi_lsa, bi_fsa;
+};
+
+/*
+ * Wall clock and cycle counter at the start of a benchmark.  The
+ * time stamp counter is only available on x86, elsewhere the cycles
+ * are not reported.
+ */
+struct bench_clock {
+	struct timespec		 bc_time;
+	uint64_t		 bc_cycles;
+};
+
+/* Statistics are formatted less often, they are much slower. */
+#define BENCH_STATDIV	100
+/* Random buffers to compare the checksum implementations. */
+#define BENCH_CHECKS	100000
+
+void	 bench_start(struct bench_clock *);
+void	 bench_stop(struct bench_clock *, const char *, unsigned long);
+void	 bench_malloc(void);
+void	 bench_pool(void);
+void	 bench_arc4random(void);
+void	 bench_random(void);
+void	 bench_cksum(const char *, size_t);
+int	 bench_cksum_orig(const void *, size_t);
+void	 bench_cksum_check(const struct cksum_method *);
+void	 bench_cksum_method(const struct cksum_method *);
+void	 bench_icmp(void);
+void	 bench_icmp6(void);
+void	 bench_payload(void);
+void	 bench_dist(const char *, enum dist_type);
+void	 bench_statistic(const char *, enum stat_format);
+
+unsigned long		 iterations = 10000000;
+void			*items[64];
+char			 buffer[1500];
+char			 checkbuf[2048 + 64];
+volatile uint32_t	 sink;
+
+void
+usage(void)
+{
+	(void)fprintf(stderr,
+	    "usage: %s [-n iterations] [-p payload] [-q quote]\n"
+	    "    -n  number of iterations of every benchmark (%lu)\n"
+	    "    -p  maximum udp packet payload size (%u)\n"
+	    "    -q  payload bytes quoted in icmp errors\n",
+	    getprogname(), iterations, payload_bound);
+	exit(2);
+}
+
+void
+setopt(int argc, char *argv[])
+{
+	const char	*errstr;
+	int		 ch;
+
+	/* Choose a random payload length like the client does with -p. */
+	payload_bound = 1000;
+	while ((ch = getopt(argc, argv, "n:p:q:")) != -1) {
+		switch (ch) {
+		case 'n':
+			iterations = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr)
+				errx(1, "iteration number is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'p':
+			payload_bound = strtonum(optarg, 0, 65508, &errstr);
+			if (errstr)
+				errx(1, "payload boundary is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'q':
+			icmp_quote = strtonum(optarg, 0, ICMP_QUOTEMAX,
+			    &errstr);
+			if (errstr)
+				errx(1, "icmp quote length is %s: %s",
+				    errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+	socket_number = sizeof(items) / sizeof(items[0]);
+}
+
+void
+bench_start(struct bench_clock *start)
+{
+	if (clock_gettime(CLOCK_MONOTONIC, &start->bc_time) == -1)
+		err(1, "clock_gettime");
+	start->bc_cycles = prof_cycles();
+}
+
+void
+bench_stop(struct bench_clock *start, const char *name, unsigned long ops)
+{
+	struct timespec	 stop, diff;
+	uint64_t	 cycles;
+	double		 ns;
+
+	cycles = prof_cycles() - start->bc_cycles;
+	if (clock_gettime(CLOCK_MONOTONIC, &stop) == -1)
+		err(1, "clock_gettime");
+	timespecsub(&stop, &start->bc_time, &diff);
+	ns = diff.tv_sec * 1e9 + diff.tv_nsec;
+	/* Without time stamp counter cycles are nanoseconds. */
+	printf("%-20s %12lu ops %10.2f ns/op %10.2f cycles/op\n",
+	    name, ops, ns / ops, (double)cycles / ops);
+}
+
+void
+bench_malloc(void)
+{
+	struct bench_clock start;
+	unsigned long	 i;
+	unsigned int	 n;
+
+	/*
+	 * Allocate and free a set of items like flows that are opened
+	 * and closed.  The free order differs from the allocation.
+	 */
+	bench_start(&start);
+	for (i = 0; i < iterations; i += socket_number) {
+		for (n = 0; n < socket_number; n++) {
+			if ((items[n] = malloc(sizeof(struct bench_item)))
+			    == NULL)
+				err(1, "malloc");
+		}
+		for (n = 0; n < socket_number; n += 2)
+			free(items[n]);
+		for (n = 1; n < socket_number; n += 2)
+			free(items[n]);
+	}
+	bench_stop(&start, "malloc/free", i);
+}
+
+void
+bench_pool(void)
+{
+	struct bench_clock start;
+	unsigned long	 i;
+	unsigned int	 n;
+
+	pool_init(&worker->w_pool, sizeof(struct bench_item), socket_number);
+	bench_start(&start);
+	for (i = 0; i < iterations; i += socket_number) {
+		for (n = 0; n < socket_number; n++)
+			items[n] = pool_get(&worker->w_pool);
+		for (n = 0; n < socket_number; n += 2)
+			pool_put(&worker->w_pool, items[n]);
+		for (n = 1; n < socket_number; n += 2)
+			pool_put(&worker->w_pool, items[n]);
+	}
+	bench_stop(&start, "pool_get/pool_put", i);
+	if (worker->w_stat[stat_poolfail])
+		errx(1, "pool exhausted %llu times",
+		    (unsigned long long)worker->w_stat[stat_poolfail]);
+}
+
+void
+bench_arc4random(void)
+{
+	struct bench_clock start;
+	unsigned long	 i;
+	uint32_t	 sum = 0;
+
+	/* Random decisions like percentages and timeouts need bounds. */
+	bench_start(&start);
+	for (i = 0; i < iterations; i++)
+		sum += arc4random_uniform(1000000);
+	bench_stop(&start, "arc4random_uniform", i);
+	sink = sum;
+}
+
+void
+bench_random(void)
+{
+	struct bench_clock start;
+	unsigned long	 i;
+	uint32_t	 sum = 0;
+
+	bench_start(&start);
+	for (i = 0; i < iterations; i++)
+		sum += random_uniform(1000000);
+	bench_stop(&start, "random_uniform", i);
+	sink = sum;
+}
+
+void
+bench_cksum(const char *name, size_t len)
+{
+	struct bench_clock start;
+	unsigned long	 i;
+	uint32_t	 sum = 0;
+
+	/*
+	 * Vary the data, otherwise the compiler could hoist the
+	 * checksum out of the loop.
+	 */
+	arc4random_buf(buffer, sizeof(buffer));
+	bench_start(&start);
+	for (i = 0; i < iterations; i++) {
+		buffer[0] = i;
+		sum += in_cksum(buffer, len);
+	}
+	bench_stop(&start, name, i);
+	sink = sum;
+}
+
+int
+bench_cksum_orig(const void *buf, size_t len)
+{
+	int sum = 0;
+
+	/* The original in_cksum loop, valid for even length only. */
+	while (len) {
+		sum += *(const u_int16_t *)buf;
+		if (sum > 0xffff)
+			sum = (sum >> 16) + (sum & 0xffff);
+		buf = (const u_int16_t *)buf + 1;
+		len -= sizeof(u_int16_t);
+	}
+	return (~sum & 0xffff);
+}
+
+void
+bench_cksum_check(const struct cksum_method *cm)
+{
+	unsigned int	 i, off, len;
+	int		 want, got;
+
+	/*
+	 * Compare with the reference at random alignment and length,
+	 * odd lengths and empty buffers included.
+	 */
+	for (i = 0; i < BENCH_CHECKS; i++) {
+		off = arc4random_uniform(64);
+		len = arc4random_uniform(sizeof(checkbuf) - 64 + 1);
+		arc4random_buf(checkbuf + off, len);
+		want = in_cksum_scalar(checkbuf + off, len);
+		if (off % 2 == 0 && len % 2 == 0 &&
+		    bench_cksum_orig(checkbuf + off, len) != want)
+			errx(1, "in_cksum scalar offset %u length %u: "
+			    "0x%04x, differs from original loop",
+			    off, len, want);
+		got = cm->cm_func(checkbuf + off, len);
+		if (got != want)
+			errx(1, "in_cksum %s offset %u length %u: "
+			    "0x%04x, should be 0x%04x",
+			    cm->cm_name, off, len, got, want);
+	}
+}
+
+void
+bench_cksum_method(const struct cksum_method *cm)
+{
+	struct bench_clock start;
+	char		 name[32];
+	unsigned long	 i;
+	uint32_t	 sum = 0;
+
+	snprintf(name, sizeof(name), "in_cksum %s", cm->cm_name);
+	arc4random_buf(buffer, sizeof(buffer));
+	bench_start(&start);
+	for (i = 0; i < iterations; i++) {
+		buffer[0] = i;
+		sum += cm->cm_func(buffer, sizeof(buffer));
+	}
+	bench_stop(&start, name, i);
+	sink = sum;
+}
+
+void
+bench_icmp(void)
+{
+	struct sockaddr_in	 lsa, fsa;
+	struct bench_clock	 start;
+	char			 packet[ICMP_PACKETMAX];
+	unsigned long		 i;
+	uint32_t		 sum = 0;
+	size_t			 len;
+
+	/*
+	 * The incrementally updated checksum must verify for any
+	 * addresses and ports.
+	 */
+	memset(&lsa, 0, sizeof(lsa));
+	lsa.sin_family = AF_INET;
+	fsa = lsa;
+	for (i = 0; i < BENCH_CHECKS; i++) {
+		lsa.sin_addr.s_addr = arc4random();
+		lsa.sin_port = arc4random();
+		fsa.sin_addr.s_addr = arc4random();
+		fsa.sin_port = arc4random();
+		len = icmp_build(packet, &lsa, &fsa);
+		if (in_cksum(packet, len) != 0)
+			errx(1, "icmp_build %s:%u -> %s:%u: bad checksum",
+			    inet_ntoa(fsa.sin_addr), ntohs(fsa.sin_port),
+			    inet_ntoa(lsa.sin_addr), ntohs(lsa.sin_port));
+	}
+
+	/*
+	 * Only construct the packet, sending needs a raw socket.  The
+	 * addresses are those of a local flow.
+	 */
+	lsa.sin_family = AF_INET;
+	lsa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	lsa.sin_port = htons(12345);
+	fsa = lsa;
+	bench_start(&start);
+	for (i = 0; i < iterations; i++) {
+		fsa.sin_port = i;
+		sum += icmp_build(packet, &lsa, &fsa);
+		sum += ((struct icmp *)packet)->icmp_cksum;
+	}
+	bench_stop(&start, "icmp_build", i);
+	sink = sum;
+}
+
+void
+bench_icmp6(void)
+{
+	struct sockaddr_in6	 lsa, fsa;
+	struct bench_clock	 start;
+	char			 packet[ICMP_PACKETMAX];
+	struct ip6_hdr		*ip6;
+	struct udphdr		*udp;
+	unsigned long		 i;
+	uint32_t		 sum = 0;
+
+	/*
+	 * The kernel computes the checksum, verify that the quoted
+	 * header carries the flow of the peer.
+	 */
+	ip6 = (struct ip6_hdr *)(packet + sizeof(struct icmp6_hdr));
+	udp = (struct udphdr *)(ip6 + 1);
+	memset(&lsa, 0, sizeof(lsa));
+	lsa.sin6_family = AF_INET6;
+	fsa = lsa;
+	for (i = 0; i < BENCH_CHECKS; i++) {
+		arc4random_buf(&lsa.sin6_addr, sizeof(lsa.sin6_addr));
+		lsa.sin6_port = arc4random();
+		arc4random_buf(&fsa.sin6_addr, sizeof(fsa.sin6_addr));
+		fsa.sin6_port = arc4random();
+		icmp6_build(packet, &lsa, &fsa);
+		if (!IN6_ARE_ADDR_EQUAL(&ip6->ip6_src, &fsa.sin6_addr) ||
+		    !IN6_ARE_ADDR_EQUAL(&ip6->ip6_dst, &lsa.sin6_addr) ||
+		    udp->uh_sport != fsa.sin6_port ||
+		    udp->uh_dport != lsa.sin6_port)
+			errx(1, "icmp6_build port %u -> %u: bad quote",
+			    ntohs(fsa.sin6_port), ntohs(lsa.sin6_port));
+	}
+
+	lsa.sin6_addr = in6addr_loopback;
+	lsa.sin6_port = htons(12345);
+	fsa = lsa;
+	bench_start(&start);
+	for (i = 0; i < iterations; i++) {
+		fsa.sin6_port = i;
+		sum += icmp6_build(packet, &lsa, &fsa);
+		sum += udp->uh_sport;
+	}
+	bench_stop(&start, "icmp6_build", i);
+	sink = sum;
+}
+
+void
+bench_payload(void)
+{
+	struct bench_clock start;
+	unsigned long	 i;
+	uint32_t	 sum = 0;
+
+	bench_start(&start);
+	for (i = 0; i < iterations; i++)
+		sum += socket_payload(sizeof(struct payload_header));
+	bench_stop(&start, "socket_payload", i);
+	sink = sum;
+}
+
+void
+bench_dist(const char *name, enum dist_type type)
+{
+	struct distribution	 d;
+	struct bench_clock	 start;
+	unsigned long		 i;
+	uint32_t		 sum = 0;
+
+	/* Draw client wait times up to 30 seconds. */
+	dist_type = type;
+	dist_init(&d, 30000000);
+	bench_start(&start);
+	for (i = 0; i < iterations; i++)
+		sum += dist_sample(&d);
+	bench_stop(&start, name, i);
+	sink = sum;
+}
+
+void
+bench_statistic(const char *name, enum stat_format format)
+{
+	struct bench_clock start;
+	unsigned long	 i, n;
+
+	/*
+	 * Format the counters of all workers with round trip times,
+	 * written to the null device.  This is what the client does
+	 * every second with -s.
+	 */
+	stat_format = format;
+	flow_statistics = 1;
+	n = iterations / BENCH_STATDIV ? iterations / BENCH_STATDIV : 1;
+	bench_start(&start);
+	for (i = 0; i < n; i++) {
+		stat_inc(stat_send);
+		hist_add(&worker->w_rtt, i);
+		statistic_callback(SIGINFO, 0, NULL);
+	}
+	bench_stop(&start, name, i);
+}
+
+void
+socket_init(void)
+{
+}
+
+void
+socket_worker(void)
+{
+	const struct cksum_method	*cm;
+
+	/*
+	 * Run all benchmarks in the main worker and exit.  No event
+	 * loop and no network is needed.
+	 */
+	bench_malloc();
+	bench_pool();
+	bench_arc4random();
+	bench_random();
+	for (cm = cksum_methods; cm->cm_name != NULL; cm++) {
+		if (!cksum_supported(cm))
+			continue;
+		bench_cksum_check(cm);
+		bench_cksum_method(cm);
+	}
+	printf("in_cksum uses %s\n", cksum_method->cm_name);
+	bench_cksum("in_cksum header", offsetof(struct payload_header,
+	    ph_cksum));
+	bench_cksum("in_cksum 1500", sizeof(buffer));
+	bench_cksum("in_cksum 1499", sizeof(buffer) - 1);
+	bench_icmp();
+	bench_icmp6();
+	bench_payload();
+	bench_dist("dist uniform", dist_uniform);
+	bench_dist("dist exponential", dist_exponential);
+	bench_dist("dist pareto", dist_pareto);
+	if ((stat_fp = fopen(_PATH_DEVNULL, "w")) == NULL)
+		err(1, "fopen %s", _PATH_DEVNULL);
+	bench_statistic("statistic text", format_text);
+	bench_statistic("statistic json", format_json);
+	bench_statistic("statistic csv", format_csv);
+	if (fclose(stat_fp) == EOF)
+		err(1, "fclose %s", _PATH_DEVNULL);
+	exit(0);
+}
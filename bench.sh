@@ -0,0 +1,132 @@
+#!/bin/sh
+#
+# Copyright (c) 2014 Alexander Bluhm <bluhm@openbsd.org>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Run sudpserver and sudpclient on loopback for every combination of
+# socket number, payload size, connected or bound sockets, icmp
+# percentage and libevent method.  Collect packet rate, cpu time,
+# packet io system calls and round trip time of each run and write
+# one line per run into a table.
+#
+# The environment overrides the parameters of the sweep.  Runs with
+# icmp errors need a raw socket, set SUDO for them.
+
+BENCH_SOCKETS=${BENCH_SOCKETS:-10 100 1000}
+BENCH_PAYLOAD=${BENCH_PAYLOAD:-0 1000 8000}
+BENCH_CONNECT=${BENCH_CONNECT:-bind connect}
+BENCH_ICMP=${BENCH_ICMP:-0 10}
+BENCH_METHOD=${BENCH_METHOD:-kqueue poll}
+BENCH_TIME=${BENCH_TIME:-5}
+BENCH_PORT=${BENCH_PORT:-12345}
+BENCH_OUT=${BENCH_OUT:-bench.txt}
+BENCH_DIR=${BENCH_DIR:-.}
+
+tmp=$(mktemp -d /tmp/sudpbench.XXXXXXXXXX) || exit 1
+trap 'kill $spid $cpid 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+
+# Summarize a csv statistics file.  Skip the first second, the
+# sockets are opened there.  Round trip percentiles are the median
+# of the percentiles of all one second intervals.  The iosc/pkt
+# column is an estimate from the statistics counters.  It includes
+# only system calls for packet io, sendmmsg and recvmmsg save some
+# of them.  Creating, binding and closing sockets and waiting for
+# events are not counted.  The cpu time of the process is reported
+# by the statistics itself, ps has only a resolution of seconds on
+# some systems.
+summary() {
+	awk -F, '
+	NR == 1 {
+		n = 0
+		for (i = 1; i <= NF; i++)
+			col[$i] = i
+		next
+	}
+	NR <= 3 {
+		cpu0 = $col["cpu_user_us"] + $col["cpu_sys_us"]
+		next
+	}
+	{
+		cpu = $col["cpu_user_us"] + $col["cpu_sys_us"] - cpu0
+		nsec += $col["interval_ns"]
+		send += $col["send"]
+		recv += $col["recv"]
+		sysc += $col["send"] - $col["sndsave"]
+		sysc += $col["recv"] - $col["rcvbatch"] + $col["rcvmmsg"]
+		if (col["rtt_p50_us"]) {
+			p50[n] = $col["rtt_p50_us"]
+			p99[n] = $col["rtt_p99_us"]
+		}
+		n++
+	}
+	function median(a, n,    i, j, t) {
+		for (i = 1; i < n; i++)
+			for (j = i; j > 0 && a[j - 1] > a[j]; j--) {
+				t = a[j]; a[j] = a[j - 1]; a[j - 1] = t
+			}
+		return (n ? a[int(n / 2)] : 0)
+	}
+	END {
+		pkt = send + recv
+		printf("%9.0f %7.2f %8.2f %6s %6s",
+		    nsec ? send * 1e9 / nsec : 0,
+		    pkt ? cpu / pkt : 0,
+		    pkt ? sysc / pkt : 0,
+		    col["rtt_p50_us"] ? median(p50, n) : "-",
+		    col["rtt_p99_us"] ? median(p99, n) : "-")
+	}' $1
+}
+
+printf "%7s %7s %7s %4s %6s | %9s %7s %8s %6s %6s | %9s %7s %8s\n" \
+    sockets payload mode icmp method \
+    cl_pps us/pkt iosc/pkt p50_us p99_us \
+    sv_pps us/pkt iosc/pkt >"$BENCH_OUT"
+
+for n in $BENCH_SOCKETS; do
+for p in $BENCH_PAYLOAD; do
+for c in $BENCH_CONNECT; do
+for i in $BENCH_ICMP; do
+for e in $BENCH_METHOD; do
+	args="-4 -s -F csv -n $n -e $e"
+	[ $p -gt 0 ] && args="$args -p $p"
+	[ $c = connect ] && args="$args -c"
+	[ $i -gt 0 ] && args="$args -i $i"
+	sudo=
+	[ $i -gt 0 ] && sudo=$SUDO
+
+	# Timeouts below a millisecond keep the sockets busy.  The
+	# server answers after 1 us, the client resends within 100 us
+	# and starts a new flow within 1 ms.
+	$sudo $BENCH_DIR/sudpserver $args -D fixed -d 1us -f $tmp/server.csv \
+	    $BENCH_PORT >/dev/null &
+	spid=$!
+	sleep 1
+	$sudo $BENCH_DIR/sudpclient $args -r 100us -w 1ms -f $tmp/client.csv \
+	    localhost $BENCH_PORT >/dev/null &
+	cpid=$!
+	sleep $BENCH_TIME
+
+	$sudo kill $cpid $spid
+	wait $cpid $spid 2>/dev/null
+	spid= cpid=
+
+	printf "%7s %7s %7s %4s %6s | %s | %s\n" $n $p $c $i $e \
+	    "$(summary $tmp/client.csv)" \
+	    "$(summary $tmp/server.csv | cut -c1-26)" \
+	    | tee -a "$BENCH_OUT"
+done
+done
+done
+done
+done
@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -21,7 +22,11 @@
 #include <err.h>
 #include <errno.h>
 #include <event.h>
+#include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -30,45 +35,104 @@
 #include "util.h"
 
 struct event_time {
+	TAILQ_ENTRY(event_time)	 et_entry;
 	struct event	 et_event;
+	struct timer	 et_timer;
 	struct timeval	 et_wait;
+	uint64_t	 et_deadline;	/* timeout is due */
+	uint64_t	 et_bitmap;	/* responses to last 64 queries */
+	uint32_t	 et_flow;
+	uint32_t	 et_seq;	/* next query number */
+	uint32_t	 et_recvseq;	/* highest response number + 1 */
+	uint32_t	 et_received;	/* number of valid responses */
 };
 
+TAILQ_HEAD(flow_list, event_time);
+
 void	 socket_start(int);
+void	 socket_flow(int, struct event_time *);
+void	 socket_query(int, struct event_time *);
+void	 socket_timeout(struct event_time *, struct timeval *);
 void	 socket_write(int, struct event_time *);
+void	 pace_init(void);
+void	 pace_callback(int, short, void *);
+int	 socket_validate(struct event_time *, struct payload_header *,
+	    ssize_t);
 void	 socket_callback(int, short, void *);
 
 struct event_base	*eb;
 const char		*host, *port;
 int			 family = PF_UNSPEC;
 unsigned int		 again_percentage;
-unsigned int		 resend_bound = 10, wait_bound = 30;
-int			 connected, oneshot, verbose;
+uint32_t		 resend_bound = 10000000, wait_bound = 30000000;
+struct distribution	 resend_dist, wait_dist;
+unsigned int		 train_number = 1;
+int			 connected, oneshot;
 struct sockaddr_storage	 lsa, fsa;
 socklen_t		 lsalen, fsalen;
 int			 socktype, protocol;
 char			 laddress[NI_MAXHOST],
 			 faddress[NI_MAXHOST], fservice[NI_MAXSERV];
+__thread uint32_t	 flow_counter;
+
+/*
+ * In open loop mode the queries are not sent by the flows.  A pacer
+ * sends them at a constant rate round robin over the open flows of
+ * the worker, regardless of the responses.
+ */
+#define PACE_INTERVAL	1000		/* pacer tick in us */
+#define PACE_SLACK	10000000ULL	/* deadline after 10 ms */
+#define PACE_MAXLAG	100000000ULL	/* skip after 100 ms */
+
+__thread struct flow_list	 pace_flows;
+__thread struct event		 pace_event;
+__thread double			 pace_next, pace_period;
+__thread uint64_t		 pace_deadline;
 
 void
 usage(void)
 {
 	(void)fprintf(stderr,
-	    "usage: %s [-46cosv] [-a again] [-i icmp] [-n num] [-p payload] "
-	    "[-r resend] [-w wait] host port\n"
+	    "usage: %s [-46cosvz] [-a again] [-D dist] [-e method] [-F format] "
+	    "[-f file]\n"
+	    "    [-g train] [-I type:code] [-i icmp] [-k keep] [-L lag] "
+	    "[-M file]\n"
+	    "    [-n num] [-p payload] [-q quote] [-R rate] [-r resend] "
+	    "[-S seed]\n"
+	    "    [-T tick] [-t threads] [-w wait] host port\n"
 	    "    -4  IPv4 only\n"
 	    "    -6  IPv6 only\n"
 	    "    -a  percentage of responses that are requested again\n"
 	    "    -c  use connected sockets to send packets\n"
+	    "    -D  distribution of times, uniform, exp[:mean], "
+	    "pareto[:shape],\n"
+	    "        fixed or empirical:file\n"
+	    "    -e  event method of libevent, e.g. kqueue, poll or select\n"
+	    "    -F  statistics format text, json or csv\n"
+	    "    -f  write statistics to file, json and csv default to stderr\n"
+	    "    -g  send trains of queries, segmented by kernel if possible,\n"
+	    "        needs -R or -a to receive all responses\n"
+	    "    -I  icmp error type and code (3:13)\n"
 	    "    -i  percentage of requests that are icmp errors\n"
+	    "    -k  percentage of finished flows that keep their socket\n"
+	    "    -L  warn if event loop lag p99 exceeds, unit us, ms or s\n"
+	    "    -M  export statistics to shared memory file\n"
 	    "    -n  number of simultanously connected sockets (%u)\n"
 	    "    -o  oneshot, do not reopen socket\n"
 	    "    -p  maximum udp packet payload size\n"
-	    "    -r  maximum resend timeout for the query in seconds (%u)\n"
+	    "    -q  payload bytes quoted in icmp errors\n"
+	    "    -R  open loop, send queries at constant rate per second\n"
+	    "    -r  maximum resend timeout for the query, unit us, ms or s "
+	    "(%us)\n"
+	    "    -S  seed for reproducible random decisions of the workers\n"
 	    "    -s  print statistics every second\n"
+	    "    -T  use timer wheel with tick granularity in microseconds\n"
+	    "    -t  number of worker threads with own event loop (%u)\n"
 	    "    -v  be verbose, print address and service\n"
-	    "    -w  maximum wait timeout for the response in seconds (%u)\n",
-	    getprogname(), socket_number, resend_bound, wait_bound);
+	    "    -w  maximum wait timeout for the response (%us)\n"
+	    "    -z  send large payloads with zero copy\n",
+	    getprogname(), socket_number, resend_bound / 1000000,
+	    worker_number, wait_bound / 1000000);
 	exit(2);
 }
 
@@ -78,7 +142,9 @@ setopt(int argc, char *argv[])
 	const char	*errstr;
 	int		 ch;
 
-	while ((ch = getopt(argc, argv, "46a:ci:n:op:r:svw:")) != -1) {
+	flow_statistics = 1;
+	while ((ch = getopt(argc, argv,
+	    "46a:cD:e:F:f:g:I:i:k:L:M:n:op:q:R:r:S:sT:t:vw:z")) != -1) {
 		switch (ch) {
 		case '4':
 			family = PF_INET;
@@ -95,12 +161,46 @@ setopt(int argc, char *argv[])
 		case 'c':
 			connected = 1;
 			break;
+		case 'D':
+			dist_parse(optarg);
+			break;
+		case 'e':
+			event_method(optarg);
+			break;
+		case 'F':
+			stat_format = statistic_format(optarg);
+			break;
+		case 'f':
+			stat_file = optarg;
+			break;
+		case 'g':
+			train_number = strtonum(optarg, 1, TRAIN_MAX, &errstr);
+			if (errstr)
+				errx(1, "train length is %s: %s",
+				    errstr, optarg);
+			udp_offload = train_number > 1;
+			break;
+		case 'I':
+			icmp_typecode(optarg);
+			break;
 		case 'i':
 			icmp_percentage = strtonum(optarg, 0, 100, &errstr);
 			if (errstr)
 				errx(1, "icmp error percentage is %s: %s",
 				    errstr, optarg);
 			break;
+		case 'k':
+			recycle_percentage = strtonum(optarg, 0, 100, &errstr);
+			if (errstr)
+				errx(1, "socket recycle percentage is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'L':
+			lag_threshold = time_parse(optarg, "lag threshold");
+			break;
+		case 'M':
+			shm_file = optarg;
+			break;
 		case 'n':
 			socket_number = strtonum(optarg, 1, 10000, &errstr);
 			if (errstr)
@@ -116,23 +216,55 @@ setopt(int argc, char *argv[])
 				errx(1, "payload boundary is %s: %s",
 				    errstr, optarg);
 			break;
+		case 'q':
+			icmp_quote = strtonum(optarg, 0, ICMP_QUOTEMAX,
+			    &errstr);
+			if (errstr)
+				errx(1, "icmp quote length is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'R':
+			send_rate = strtonum(optarg, 1, 100000000, &errstr);
+			if (errstr)
+				errx(1, "send rate is %s: %s",
+				    errstr, optarg);
+			break;
 		case 'r':
-			resend_bound = strtonum(optarg, 1, 60, &errstr);
+			resend_bound = time_parse(optarg, "resend boundary");
+			break;
+		case 'S':
+			random_seed = strtonum(optarg, 0, LLONG_MAX, &errstr);
 			if (errstr)
-				errx(1, "resend boundary time is %s: %s",
+				errx(1, "random seed is %s: %s",
 				    errstr, optarg);
+			random_seeded = 1;
 			break;
 		case 's':
 			statistics = 1;
 			break;
+		case 'T':
+			timer_tick = strtonum(optarg, 1, 1000000, &errstr);
+			if (errstr)
+				errx(1, "timer tick is %s: %s",
+				    errstr, optarg);
+			break;
+		case 't':
+			worker_number = strtonum(optarg, 1, 256, &errstr);
+			if (errstr)
+				errx(1, "worker thread number is %s: %s",
+				    errstr, optarg);
+			break;
 		case 'v':
 			verbose = 1;
 			break;
 		case 'w':
-			wait_bound = strtonum(optarg, 1, 60, &errstr);
-			if (errstr)
-				errx(1, "wait boundary time is %s: %s",
-				    errstr, optarg);
+			wait_bound = time_parse(optarg, "wait boundary");
+			break;
+		case 'z':
+#ifndef SO_ZEROCOPY
+			errx(1, "zero copy send SO_ZEROCOPY not supported");
+#endif
+			zerocopy = 1;
 			break;
 		default:
 			usage();
@@ -142,14 +274,33 @@ setopt(int argc, char *argv[])
 	argv += optind;
 	if (argc != 2)
 		usage();
+	if (zerocopy && payload_bound < ZEROCOPY_MINLEN)
+		errx(1, "zero copy needs payload of at least %u bytes",
+		    ZEROCOPY_MINLEN);
+	if (zerocopy && train_number > 1)
+		errx(1, "zero copy cannot be used with trains");
+	/* The first response would end the flow in closed loop mode. */
+	if (train_number > 1 && !send_rate && !again_percentage)
+		errx(1, "trains need open loop -R or request again -a");
+#ifndef UDP_SEGMENT
+	if (train_number > 1)
+		warnx("segmentation offload UDP_SEGMENT not supported, "
+		    "trains are sent with sendmmsg");
+#endif
+	if (worker_number > socket_number)
+		errx(1, "worker thread number %u exceeds socket number %u",
+		    worker_number, socket_number);
 	host = argv[0];
 	port = argv[1];
+	dist_init(&resend_dist, resend_bound);
+	dist_init(&wait_dist, wait_bound);
 }
 
 void
 socket_start(int s)
 {
 	struct event_time	*et;
+	PROFILE_SCOPE(prof_start);
 
 	/*
 	 * Create and bind a socket, send a packet and wait for the
@@ -163,80 +314,214 @@ socket_start(int s)
 			err(1, "connect foreign address %s, service %s",
 			    faddress, fservice);
 	} else {
-		switch (family) {
-		case AF_INET:
-			((struct sockaddr_in *)&lsa)->sin_port = 0;
-			break;
-		case AF_INET6:
-			((struct sockaddr_in6 *)&lsa)->sin6_port = 0;
-			break;
-		}
 		if (bind(s, (struct sockaddr *)&lsa, lsalen) == -1)
 			err(1, "bind local address %s", laddress);
 	}
-	if ((et = malloc(sizeof(*et))) == NULL)
-		err(1, "malloc");
+	if (zerocopy)
+		zerocopy_socket(s);
+	et = pool_get(&worker->w_pool);
 	event_set(&et->et_event, s, EV_READ|EV_PERSIST, socket_callback, et);
-	et->et_wait.tv_sec = arc4random_uniform(wait_bound);
-	et->et_wait.tv_usec = 1 + arc4random_uniform(999999);
-	socket_write(s, et);
-	stat_open++;
+	event_base_set(worker->w_base, &et->et_event);
+	timer_set(&et->et_timer, s, socket_callback, et);
+	socket_flow(s, et);
+	stat_inc(stat_open);
 }
 
 void
-socket_write(int s, struct event_time *et)
+socket_flow(int s, struct event_time *et)
 {
-	struct timeval	 to;
+	/*
+	 * Start a new flow on the socket.  A recycled socket may still
+	 * receive late responses of its previous flow, they are counted
+	 * as wrong flow.  The worker number makes the flow identifier
+	 * unique.
+	 */
+	et->et_flow = (worker->w_id << 24) | (flow_counter++ & 0xffffff);
+	et->et_seq = 0;
+	et->et_recvseq = 0;
+	et->et_received = 0;
+	et->et_bitmap = 0;
+	dist_timeval(&wait_dist, &et->et_wait);
+	if (send_rate) {
+		/* The pacer sends the queries, just wait. */
+		TAILQ_INSERT_TAIL(&pace_flows, et, et_entry);
+		socket_timeout(et, &et->et_wait);
+		timerclear(&et->et_wait);
+	} else
+		socket_write(s, et);
+}
 
-	if (family == AF_INET && icmp_percentage &&
-	    icmp_percentage > arc4random_uniform(100)) {
-		lsalen = sizeof(lsa);
-		if (getsockname(s, (struct sockaddr *)&lsa, &lsalen) == -1)
+void
+socket_query(int s, struct event_time *et)
+{
+	if (icmp_percentage && icmp_percentage > random_uniform(100)) {
+		struct sockaddr_storage	 ss;
+		socklen_t		 sslen;
+
+		sslen = sizeof(ss);
+		if (getsockname(s, (struct sockaddr *)&ss, &sslen) == -1)
 			err(1, "getsockname");
-		icmp_send((struct sockaddr_in *)&lsa, lsalen,
-		    (struct sockaddr_in *)&fsa, fsalen);
+		icmp_send((struct sockaddr *)&ss, sslen,
+		    (struct sockaddr *)&fsa, fsalen);
 	} else {
-		if (connected)
-			socket_send(s, "foo\n", NULL, 0);
+		struct payload_header	 ph[TRAIN_MAX];
+		uint64_t		 now;
+		unsigned int		 i;
+
+		/*
+		 * The response carries the header back to measure rtt.
+		 * Every query of a train has its own sequence number.
+		 */
+		memset(ph, 0, train_number * sizeof(ph[0]));
+		now = monotonic_nsec();
+		for (i = 0; i < train_number; i++) {
+			ph[i].ph_flow = et->et_flow;
+			ph[i].ph_seq = et->et_seq;
+			ph[i].ph_time = now;
+			ph[i].ph_cksum = in_cksum(&ph[i],
+			    offsetof(struct payload_header, ph_cksum));
+			et->et_bitmap &= ~(1ULL << (et->et_seq & 63));
+			et->et_seq++;
+		}
+		if (train_number > 1)
+			socket_train(s, ph, train_number,
+			    (struct sockaddr *)&fsa, connected ? 0 : fsalen);
+		else if (zerocopy)
+			zerocopy_send(s, ph, sizeof(ph[0]),
+			    (struct sockaddr *)&fsa, connected ? 0 : fsalen);
+		else if (connected)
+			socket_send(s, ph, sizeof(ph[0]), NULL, 0);
 		else
-			socket_send(s, "foo\n",
+			socket_send(s, ph, sizeof(ph[0]),
 			    (struct sockaddr *)&fsa, fsalen);
 	}
+}
+
+void
+socket_timeout(struct event_time *et, struct timeval *to)
+{
+	et->et_deadline = lag_deadline(to);
+	if (timer_tick) {
+		event_add(&et->et_event, NULL);
+		timer_add(&et->et_timer, to);
+	} else
+		event_add(&et->et_event, to);
+}
+
+void
+socket_write(int s, struct event_time *et)
+{
+	struct timeval	 to;
+	PROFILE_SCOPE(prof_write);
+
+	socket_query(s, et);
 
 	/*
 	 * Chose a random resend timeout.  If it is greater than the wait
 	 * timeout stop retransmitting.  The wait fields indicates how long
 	 * we will have to wait after the next timeout.
 	 */
-	to.tv_sec = arc4random_uniform(resend_bound);
-	to.tv_usec = 1 + arc4random_uniform(999999);
+	dist_timeval(&resend_dist, &to);
 	if (timercmp(&to, &et->et_wait, <)) {
 		timersub(&et->et_wait, &to, &et->et_wait);
 	} else {
 		to = et->et_wait;
 		timerclear(&et->et_wait);
 	}
-	event_add(&et->et_event, &to);
+	socket_timeout(et, &to);
+}
+
+int
+socket_validate(struct event_time *et, struct payload_header *ph, ssize_t n)
+{
+	uint64_t	 bit;
+
+	if (n != sizeof(*ph) || ph->ph_cksum != in_cksum(ph,
+	    offsetof(struct payload_header, ph_cksum))) {
+		stat_inc(stat_corrupt);
+		return (-1);
+	}
+	if (ph->ph_flow != et->et_flow) {
+		stat_inc(stat_wrongflow);
+		return (-1);
+	}
+	if (ph->ph_seq >= et->et_seq) {
+		/* This query has never been sent. */
+		stat_inc(stat_corrupt);
+		return (-1);
+	}
+
+	/*
+	 * The bitmap contains one bit for each of the last 64 queries,
+	 * indexed by sequence number modulo 64.  Older responses cannot
+	 * be checked for duplicates.
+	 */
+	if (ph->ph_seq + 64 >= et->et_seq) {
+		bit = 1ULL << (ph->ph_seq & 63);
+		if (et->et_bitmap & bit) {
+			stat_inc(stat_dup);
+			return (-1);
+		}
+		et->et_bitmap |= bit;
+	}
+	if (ph->ph_seq + 1 < et->et_recvseq)
+		stat_inc(stat_reorder);
+	else
+		et->et_recvseq = ph->ph_seq + 1;
+	et->et_received++;
+	return (0);
 }
 
 void
 socket_callback(int s, short event, void *arg)
 {
 	struct event_time	*et = arg;
+	PROFILE_SCOPE(prof_callback);
 
 	if (event & EV_READ) {
-		char	 rbuf[16];
+		struct payload_header	 ph;
+		struct iovec		 iov[2];
+		struct msghdr		 msg;
+		ssize_t			 n;
 
-		if (recv(s, rbuf, sizeof(rbuf), 0) == -1)
-			stat_rcverr++;
-		else
-			stat_recv++;
+		/*
+		 * Zero copy completions wake us up although there may
+		 * be no response to read.
+		 */
+		if (zerocopy)
+			zerocopy_reap(s);
+		socket_rcviov(iov, &ph, sizeof(ph));
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		if ((n = recvmsg(s, &msg,
+		    zerocopy ? MSG_DONTWAIT : 0)) == -1) {
+			if (zerocopy && errno == EAGAIN)
+				return;
+			stat_inc(stat_rcverr);
+		} else {
+			stat_inc(stat_recv);
+			stat_add(stat_rcvbytes, n);
+			if ((size_t)n > sizeof(ph))
+				n = sizeof(ph);
+			if (socket_validate(et, &ph, n) == 0)
+				hist_add(&worker->w_rtt,
+				    monotonic_nsec() - ph.ph_time);
+		}
 
+		/*
+		 * In open loop mode only the wait timeout closes.  Every
+		 * response restarts the timeout of the persistent event,
+		 * end the flow when its deadline has passed.
+		 */
+		if (send_rate && monotonic_nsec() < et->et_deadline)
+			return;
 		if (again_percentage &&
-		    again_percentage > arc4random_uniform(100))
+		    again_percentage > random_uniform(100))
 			return;
 	}
 	if (event & EV_TIMEOUT) {
+		lag_record(et->et_deadline);
 		/*
 		 * If we have not reached the final wait time,
 		 * send another packet and wait for the response.
@@ -247,21 +532,102 @@ socket_callback(int s, short event, void *arg)
 		}
 	}
 	/*
-	 * We close the connection after we got a response or reached the
-	 * wait interval.
+	 * The flow ends after we got a response or reached the wait
+	 * interval.  Queries that are still unanswered, retransmits or
+	 * the rest of a train, are lost.  A fraction of the flows keeps
+	 * the socket and starts the next flow on it, the others close
+	 * the connection.
 	 */
-	if (close(s) == -1)
+	if (et->et_seq > et->et_received)
+		stat_add(stat_lost, et->et_seq - et->et_received);
+	if (!oneshot && recycle_percentage &&
+	    recycle_percentage > random_uniform(100)) {
+		if (send_rate)
+			TAILQ_REMOVE(&pace_flows, et, et_entry);
+		stat_inc(stat_recycle);
+		socket_flow(s, et);
+		return;
+	}
+	if (zerocopy)
+		zerocopy_close(s);
+	else if (close(s) == -1)
 		err(1, "close");
 	event_del(&et->et_event);
-	free(et);
-	stat_open--;
-	if (!oneshot)
+	timer_del(&et->et_timer);
+	if (send_rate)
+		TAILQ_REMOVE(&pace_flows, et, et_entry);
+	pool_put(&worker->w_pool, et);
+	stat_dec(stat_open);
+	if (!oneshot) {
+		stat_inc(stat_churn);
 		socket_start(s);
-	if (oneshot && stat_open == 0) {
-		if (icmp_percentage)
-			icmp_destroy();
-		statistic_destroy();
 	}
+	if (oneshot && stat_get(stat_open) == 0) {
+		if (send_rate)
+			event_del(&pace_event);
+		worker_done();
+	}
+}
+
+void
+pace_init(void)
+{
+	struct timeval	 to;
+	unsigned int	 rate;
+
+	TAILQ_INIT(&pace_flows);
+	rate = send_rate / worker_number +
+	    (worker->w_id < send_rate % worker_number);
+	if (rate == 0)
+		return;
+	pace_period = 1e9 / rate;
+	pace_next = monotonic_nsec();
+
+	evtimer_set(&pace_event, pace_callback, &pace_event);
+	event_base_set(worker->w_base, &pace_event);
+	to.tv_sec = 0;
+	to.tv_usec = PACE_INTERVAL;
+	pace_deadline = lag_deadline(&to);
+	evtimer_add(&pace_event, &to);
+}
+
+void
+pace_callback(int fd, short event, void *arg)
+{
+	struct event_time	*et;
+	struct timeval		 to;
+	uint64_t		 now, skip;
+
+	/*
+	 * Every query has a scheduled send time.  Send all queries that
+	 * are due.  The kernel timer resolution may be coarser than the
+	 * pacer tick, the send deadline is missed after PACE_SLACK.  If
+	 * it is so far behind that it cannot catch up, skip the queries
+	 * and count the shortfall.
+	 */
+	lag_record(pace_deadline);
+	now = monotonic_nsec();
+	if (now > pace_next + PACE_MAXLAG) {
+		skip = (now - pace_next - PACE_MAXLAG) / pace_period + 1;
+		stat_add(stat_shortfall, skip);
+		pace_next += skip * pace_period;
+	}
+	while (pace_next <= now) {
+		if (now - pace_next > PACE_SLACK)
+			stat_inc(stat_sndlate);
+		if ((et = TAILQ_FIRST(&pace_flows)) != NULL) {
+			TAILQ_REMOVE(&pace_flows, et, et_entry);
+			TAILQ_INSERT_TAIL(&pace_flows, et, et_entry);
+			socket_query(EVENT_FD(&et->et_event), et);
+		} else
+			stat_inc(stat_shortfall);
+		pace_next += pace_period;
+	}
+
+	to.tv_sec = 0;
+	to.tv_usec = PACE_INTERVAL;
+	pace_deadline = lag_deadline(&to);
+	evtimer_add(&pace_event, &to);
 }
 
 void
@@ -271,7 +637,6 @@ socket_init(void)
 	const char	*cause = NULL;
 	int		 s;
 	int		 error, save_errno;
-	unsigned int	 n;
 
 	/*
 	 * Find a suitable connect address and remember it.  Create
@@ -344,14 +709,41 @@ socket_init(void)
 		if (verbose)
 			printf("%s local address %s\n",
 			    getprogname(), laddress);
+		switch (family) {
+		case AF_INET:
+			((struct sockaddr_in *)&lsa)->sin_port = 0;
+			break;
+		case AF_INET6:
+			((struct sockaddr_in6 *)&lsa)->sin6_port = 0;
+			break;
+		}
 	}
 	if (close(s) == -1)
 		err(1, "close");
+	if (verbose) {
+		printf("%s event method %s\n",
+		    getprogname(), event_get_method());
+		printf("%s random seed %llu\n",
+		    getprogname(), (unsigned long long)random_seed);
+	}
+}
+
+void
+socket_worker(void)
+{
+	unsigned int	 n;
 
 	/*
-	 * Create and connect all sockets and hook them into the event
-	 * loop.  The kernel automatically binds the local address.
+	 * Create and connect all sockets of this worker and hook them
+	 * into its event loop.  The kernel automatically binds the
+	 * local address.  Every socket needs one event structure.
 	 */
-	for (n = 0; n < socket_number; n++)
-		socket_start(s);
+	pool_init(&worker->w_pool, sizeof(struct event_time),
+	    worker->w_sockets);
+	if (send_rate)
+		pace_init();
+	if (zerocopy)
+		zerocopy_init();
+	for (n = 0; n < worker->w_sockets; n++)
+		socket_start(-1);
 }
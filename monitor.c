@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2014 Alexander Bluhm <bluhm@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <event.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define MONITOR_RETRY	1000	/* attempts to get a consistent copy */
+
+const struct stat_shm	*monitor_open(void);
+void	 monitor_read(const struct stat_shm *, struct stat_shm *);
+void	 monitor_print(const struct stat_shm *, const struct stat_shm *);
+
+const char		*monitor_file;
+unsigned int		 monitor_interval = 100;
+unsigned long		 monitor_count;
+struct stat_shm		 sample[2];
+struct histogram	 drtt;
+
+void
+usage(void)
+{
+	(void)fprintf(stderr,
+	    "usage: %s [-c count] [-i interval] file\n"
+	    "    -c  number of samples, default until interrupted\n"
+	    "    -i  sample interval in milliseconds (%u)\n",
+	    getprogname(), monitor_interval);
+	exit(2);
+}
+
+void
+setopt(int argc, char *argv[])
+{
+	const char	*errstr;
+	int		 ch;
+
+	while ((ch = getopt(argc, argv, "c:i:")) != -1) {
+		switch (ch) {
+		case 'c':
+			monitor_count = strtonum(optarg, 1, LONG_MAX, &errstr);
+			if (errstr)
+				errx(1, "sample count is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'i':
+			monitor_interval = strtonum(optarg, 1, 3600000,
+			    &errstr);
+			if (errstr)
+				errx(1, "sample interval is %s: %s",
+				    errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+	monitor_file = argv[0];
+	socket_number = 1;
+}
+
+const struct stat_shm *
+monitor_open(void)
+{
+	const struct stat_shm	*sh;
+	struct stat		 st;
+	int			 fd;
+
+	if ((fd = open(monitor_file, O_RDONLY)) == -1)
+		err(1, "open %s", monitor_file);
+	if (fstat(fd, &st) == -1)
+		err(1, "fstat %s", monitor_file);
+	if (st.st_size < (off_t)sizeof(*sh))
+		errx(1, "%s: file too short for statistics", monitor_file);
+	sh = mmap(NULL, sizeof(*sh), PROT_READ, MAP_SHARED, fd, 0);
+	if (sh == MAP_FAILED)
+		err(1, "mmap %s", monitor_file);
+	if (close(fd) == -1)
+		err(1, "close");
+
+	if (sh->sh_magic != SHM_MAGIC)
+		errx(1, "%s: bad magic 0x%08x", monitor_file, sh->sh_magic);
+	if (sh->sh_version != SHM_VERSION ||
+	    sh->sh_ncounters != stat_ncounters ||
+	    sh->sh_nbuckets != HIST_BUCKETS)
+		errx(1, "%s: layout version %u does not match %u",
+		    monitor_file, sh->sh_version, SHM_VERSION);
+	return (sh);
+}
+
+void
+monitor_read(const struct stat_shm *sh, struct stat_shm *copy)
+{
+	uint64_t	 seq;
+	unsigned int	 retry;
+
+	/*
+	 * The writer increments the sequence number before and after
+	 * the update.  Copy while it is even and has not changed.
+	 */
+	for (retry = 0; retry < MONITOR_RETRY; retry++) {
+		seq = sh->sh_seq;
+		if (seq & 1)
+			continue;
+		__sync_synchronize();
+		memcpy(copy, (const void *)sh, sizeof(*copy));
+		__sync_synchronize();
+		if (seq == sh->sh_seq)
+			return;
+	}
+	errx(1, "%s: no consistent statistics after %u attempts",
+	    monitor_file, MONITOR_RETRY);
+}
+
+void
+monitor_print(const struct stat_shm *old, const struct stat_shm *new)
+{
+	uint64_t	 nsec, total;
+	unsigned int	 c;
+	static uint64_t	 start;
+	static int	 line;
+
+#define RATE(c)	((new->sh_stat[c] - old->sh_stat[c]) * 1e9 / nsec)
+
+	if (start == 0)
+		start = old->sh_time;
+	nsec = new->sh_time - old->sh_time;
+	for (c = 0; c < HIST_BUCKETS; c++)
+		drtt.h_count[c] = new->sh_rtt.h_count[c] -
+		    old->sh_rtt.h_count[c];
+	total = hist_total(&drtt);
+
+	if (line-- == 0) {
+		printf(" %9s %7s %9s %9s %11s %11s %7s %7s %7s %7s\n",
+		    "time_s", "open", "send_pps", "recv_pps", "send_Bps",
+		    "recv_Bps", "err_ps", "lost", "p50_us", "p99_us");
+		line = 19;
+	}
+	printf(" %9.3f %7llu %9.0f %9.0f %11.0f %11.0f %7.0f %7llu"
+	    " %7llu %7llu\n",
+	    (new->sh_time - start) / 1e9,
+	    (unsigned long long)new->sh_stat[stat_open],
+	    RATE(stat_send), RATE(stat_recv),
+	    RATE(stat_sndbytes), RATE(stat_rcvbytes),
+	    RATE(stat_snderr) + RATE(stat_rcverr) + RATE(stat_error),
+	    (unsigned long long)(new->sh_stat[stat_lost] -
+	    old->sh_stat[stat_lost]),
+	    (unsigned long long)(hist_percentile(&drtt, total, 50) / 1000),
+	    (unsigned long long)(hist_percentile(&drtt, total, 99) / 1000));
+	fflush(stdout);
+#undef RATE
+}
+
+void
+socket_init(void)
+{
+}
+
+void
+socket_worker(void)
+{
+	const struct stat_shm	*sh;
+	struct timespec		 ts;
+	unsigned long		 n;
+	int			 cur = 0;
+
+	/*
+	 * Sample the shared memory of a running client or server and
+	 * print the rates between samples.  No event loop is needed.
+	 * Samples without an update of the writer are skipped.
+	 */
+	sh = monitor_open();
+	monitor_read(sh, &sample[cur]);
+	ts.tv_sec = monitor_interval / 1000;
+	ts.tv_nsec = (monitor_interval % 1000) * 1000000L;
+	for (n = 0; monitor_count == 0 || n < monitor_count; ) {
+		if (nanosleep(&ts, NULL) == -1)
+			err(1, "nanosleep");
+		monitor_read(sh, &sample[!cur]);
+		if (sample[!cur].sh_time == sample[cur].sh_time)
+			continue;
+		monitor_print(&sample[cur], &sample[!cur]);
+		cur = !cur;
+		n++;
+	}
+	exit(0);
+}
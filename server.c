@@ -14,15 +14,21 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/uio.h>
 
+#include <netinet/in.h>
+
 #include <err.h>
 #include <errno.h>
 #include <event.h>
+#include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -32,43 +38,104 @@
 
 struct event_addr {
 	struct event		 ea_event;
+	struct timer		 ea_timer;
 	struct sockaddr_storage  ea_lsa, ea_fsa;
 	int			 ea_family, ea_socktype, ea_protocol;
 	socklen_t                ea_lsalen, ea_fsalen;
+	struct payload_header	 ea_hdr;
+	size_t			 ea_hdrlen;
+	LIST_ENTRY(event_addr)	 ea_hash;	/* socket cache */
+	TAILQ_ENTRY(event_addr)	 ea_lru;	/* idle in use order */
+	struct event_addr	*ea_listen;
+	uint64_t		 ea_deadline;	/* timeout is due */
+	int			 ea_idle;
+};
+LIST_HEAD(cache_bucket, event_addr);
+TAILQ_HEAD(cache_lru, event_addr);
+
+union cmsgbuf {
+	struct cmsghdr	 hdr;
+	unsigned char	 buf[CMSG_SPACE(sizeof(struct in_addr))+
+			    CMSG_SPACE(sizeof(in_port_t))];
+	unsigned char	 buf6[CMSG_SPACE(sizeof(struct in6_pktinfo))+
+			    CMSG_SPACE(sizeof(in_port_t))];
 };
 
+void	 socket_cmsg(struct msghdr *, struct event_addr *);
 ssize_t	 socket_recv(int, struct event_addr *);
+void	 socket_recvmmsg(int, struct event_addr *);
+struct event_addr *socket_query(int, struct event_addr *, struct event_addr *);
+void	 socket_delay(struct event_addr *);
 void	 socket_read(int, struct event_addr *);
 void	 socket_write(int, struct event_addr *);
 void	 socket_callback(int, short, void *);
+void	 cache_init(void);
+struct cache_bucket *cache_bucket(const struct event_addr *,
+	    const struct sockaddr_storage *);
+struct event_addr *cache_lookup(const struct event_addr *,
+	    const struct sockaddr_storage *);
+void	 cache_insert(struct event_addr *);
+void	 cache_remove(struct event_addr *);
+void	 cache_wakeup(struct event_addr *);
+void	 cache_park(struct event_addr *);
+void	 cache_close(struct event_addr *);
+void	 cache_flush(void);
 
 struct event_base	*eb;
-struct event_addr	*eladdr;
+struct event_addr	*ealisten;
+unsigned int		 nlisten;
+__thread struct event_addr	*eladdr;
 const char		*host, *port;
 int			 family = PF_UNSPEC;
-unsigned int		 delay_bound = 10;
+uint32_t		 delay_bound = 10000000;
+struct distribution	 delay_dist;
 unsigned int		 icmp_percentage;
-int			 connected, oneshot, verbose;
-char			 laddress[NI_MAXHOST], lservice[NI_MAXSERV];
+int			 connected, oneshot;
+unsigned int		 cache_linger = 10;
+__thread struct cache_bucket	*cache_table;
+__thread unsigned int		 cache_mask;
+__thread struct cache_lru	 cache_lru;
 
 void
 usage(void)
 {
 	(void)fprintf(stderr,
-	    "usage: %s [-46cosv] [-b bind] [-d delay] [-i icmp] [-n num] "
-	    " [-p payload] port\n"
+	    "usage: %s [-46cosv] [-b bind] [-C cache] [-D dist] [-d delay] "
+	    "[-e method]\n"
+	    "    [-F format] [-f file] [-I type:code] [-i icmp] [-L lag] "
+	    "[-l linger]\n"
+	    "    [-M file] [-m mmsg] [-n num] [-p payload] [-q quote] "
+	    "[-S seed]\n"
+	    "    [-T tick] [-t threads] port\n"
 	    "    -4  IPv4 only\n"
 	    "    -6  IPv6 only\n"
 	    "    -b  bind socket to address\n"
+	    "    -C  number of idle connected sockets cached per worker\n"
 	    "    -c  use connected sockets to send packets\n"
-	    "    -d  maximum delay for the response in seconds (%u)\n"
+	    "    -D  distribution of times, uniform, exp[:mean], "
+	    "pareto[:shape],\n"
+	    "        fixed or empirical:file\n"
+	    "    -d  maximum delay for the response, unit us, ms or s (%us)\n"
+	    "    -e  event method of libevent, e.g. kqueue, poll or select\n"
+	    "    -F  statistics format text, json or csv\n"
+	    "    -f  write statistics to file, json and csv default to stderr\n"
+	    "    -I  icmp error type and code (3:13)\n"
 	    "    -i  percentage of responses that are icmp errors\n"
+	    "    -L  warn if event loop lag p99 exceeds, unit us, ms or s\n"
+	    "    -l  linger time of idle cached sockets in seconds (%u)\n"
+	    "    -M  export statistics to shared memory file\n"
+	    "    -m  maximum number of packets per recvmmsg and sendmmsg (%u)\n"
 	    "    -n  maximum number of simultanously bind sockets (%u)\n"
 	    "    -o  oneshot, do not reopen socket\n"
 	    "    -p  maximum udp packet payload size\n"
+	    "    -q  payload bytes quoted in icmp errors\n"
+	    "    -S  seed for reproducible random decisions of the workers\n"
 	    "    -s  print statistics every second\n"
+	    "    -T  use timer wheel with tick granularity in microseconds\n"
+	    "    -t  number of worker threads with own event loop (%u)\n"
 	    "    -v  be verbose, print address and service\n",
-	    getprogname(), socket_number, delay_bound);
+	    getprogname(), delay_bound / 1000000, cache_linger, mmsg_number,
+	    socket_number, worker_number);
 	exit(2);
 }
 
@@ -78,7 +145,8 @@ setopt(int argc, char *argv[])
 	const char	*errstr;
 	int		 ch;
 
-	while ((ch = getopt(argc, argv, "46b:cd:i:n:op:sv")) != -1) {
+	while ((ch = getopt(argc, argv,
+	    "46b:C:cD:d:e:F:f:I:i:L:l:M:m:n:op:q:S:sT:t:v")) != -1) {
 		switch (ch) {
 		case '4':
 			family = PF_INET;
@@ -89,14 +157,32 @@ setopt(int argc, char *argv[])
 		case 'b':
 			host = optarg;
 			break;
+		case 'C':
+			cache_size = strtonum(optarg, 0, 100000, &errstr);
+			if (errstr)
+				errx(1, "connected socket cache size is %s: %s",
+				    errstr, optarg);
+			break;
 		case 'c':
 			connected = 1;
 			break;
+		case 'D':
+			dist_parse(optarg);
+			break;
 		case 'd':
-			delay_bound = strtonum(optarg, 1, 60, &errstr);
-			if (errstr)
-				errx(1, "delay boundary time is %s: %s",
-				    errstr, optarg);
+			delay_bound = time_parse(optarg, "delay boundary");
+			break;
+		case 'e':
+			event_method(optarg);
+			break;
+		case 'F':
+			stat_format = statistic_format(optarg);
+			break;
+		case 'f':
+			stat_file = optarg;
+			break;
+		case 'I':
+			icmp_typecode(optarg);
 			break;
 		case 'i':
 			icmp_percentage = strtonum(optarg, 0, 100, &errstr);
@@ -104,6 +190,24 @@ setopt(int argc, char *argv[])
 				errx(1, "icmp error percentage is %s: %s",
 				    errstr, optarg);
 			break;
+		case 'L':
+			lag_threshold = time_parse(optarg, "lag threshold");
+			break;
+		case 'l':
+			cache_linger = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr)
+				errx(1, "cache linger time is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'M':
+			shm_file = optarg;
+			break;
+		case 'm':
+			mmsg_number = strtonum(optarg, 1, UIO_MAXIOV, &errstr);
+			if (errstr)
+				errx(1, "mmsg packet number is %s: %s",
+				    errstr, optarg);
+			break;
 		case 'n':
 			socket_number = strtonum(optarg, 1, 10000, &errstr);
 			if (errstr)
@@ -119,9 +223,35 @@ setopt(int argc, char *argv[])
 				errx(1, "payload boundary is %s: %s",
 				    errstr, optarg);
 			break;
+		case 'q':
+			icmp_quote = strtonum(optarg, 0, ICMP_QUOTEMAX,
+			    &errstr);
+			if (errstr)
+				errx(1, "icmp quote length is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'S':
+			random_seed = strtonum(optarg, 0, LLONG_MAX, &errstr);
+			if (errstr)
+				errx(1, "random seed is %s: %s",
+				    errstr, optarg);
+			random_seeded = 1;
+			break;
 		case 's':
 			statistics = 1;
 			break;
+		case 'T':
+			timer_tick = strtonum(optarg, 1, 1000000, &errstr);
+			if (errstr)
+				errx(1, "timer tick is %s: %s",
+				    errstr, optarg);
+			break;
+		case 't':
+			worker_number = strtonum(optarg, 1, 256, &errstr);
+			if (errstr)
+				errx(1, "worker thread number is %s: %s",
+				    errstr, optarg);
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -133,43 +263,33 @@ setopt(int argc, char *argv[])
 	argv += optind;
 	if (argc != 1)
 		usage();
+	/*
+	 * A oneshot worker stops after it has sent its responses.  The
+	 * kernel may never pass a packet to some of the workers.
+	 */
+	if (oneshot && worker_number > 1)
+		errx(1, "oneshot cannot be used with multiple worker threads");
+	if (cache_size && !connected)
+		errx(1, "connected socket cache needs connected sockets");
+#ifdef __OpenBSD__
+	if (!connected && worker_number > 1)
+		warnx("SO_REUSEPORT does not spread udp, "
+		    "only one of %u workers receives queries", worker_number);
+#endif
 	port = argv[0];
+	dist_init(&delay_dist, delay_bound);
 }
 
-ssize_t
-socket_recv(int s, struct event_addr *ea)
+void
+socket_cmsg(struct msghdr *msg, struct event_addr *ea)
 {
-	char		 rbuf[16];
-	struct iovec	 iov;
-	struct msghdr	 msg;
 	struct cmsghdr	*cmsg;
-	union {
-		struct cmsghdr	 hdr;
-		unsigned char	 buf[CMSG_SPACE(sizeof(struct in_addr))+
-				    CMSG_SPACE(sizeof(in_port_t))];
-		unsigned char	 buf6[CMSG_SPACE(sizeof(struct in6_pktinfo))+
-				    CMSG_SPACE(sizeof(in_port_t))];
-	} cmsgbuf;
-	ssize_t		 n;
-
-	iov.iov_base = rbuf;
-	iov.iov_len = sizeof(rbuf);
-	msg.msg_name = &ea->ea_fsa;
-	msg.msg_namelen = sizeof(ea->ea_fsa);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-	msg.msg_control = &cmsgbuf.buf;
-	msg.msg_controllen = sizeof(cmsgbuf);
-	msg.msg_flags = 0;
-
-	if ((n = recvmsg(s, &msg, 0)) == -1)
-		return (n);
 
 	ea->ea_fsalen = ea->ea_fsa.ss_len;
-	if (msg.msg_flags & MSG_CTRUNC)
+	if (msg->msg_flags & MSG_CTRUNC)
 		errx(1, "recvmsg: control message truncated");
-	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
-	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(msg, cmsg)) {
 		if (cmsg->cmsg_len == CMSG_LEN(sizeof(struct in_addr)) &&
 		    cmsg->cmsg_level == IPPROTO_IP &&
 		    cmsg->cmsg_type == IP_RECVDSTADDR) {
@@ -197,111 +317,282 @@ socket_recv(int s, struct event_addr *ea)
 			    *(in_port_t *)CMSG_DATA(cmsg);
 		}
 	}
+}
+
+ssize_t
+socket_recv(int s, struct event_addr *ea)
+{
+	struct iovec	 iov[2];
+	struct msghdr	 msg;
+	union cmsgbuf	 cmsgbuf;
+	ssize_t		 n;
+	PROFILE_SCOPE(prof_recv);
+
+	/* Keep the query header, it is echoed in the response. */
+	socket_rcviov(iov, &ea->ea_hdr, sizeof(ea->ea_hdr));
+	msg.msg_name = &ea->ea_fsa;
+	msg.msg_namelen = sizeof(ea->ea_fsa);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = &cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+	msg.msg_flags = 0;
+
+	if ((n = recvmsg(s, &msg, 0)) == -1)
+		return (n);
+	stat_add(stat_rcvbytes, n);
+	ea->ea_hdrlen = (size_t)n < sizeof(ea->ea_hdr) ?
+	    (size_t)n : sizeof(ea->ea_hdr);
+	socket_cmsg(&msg, ea);
 
 	return (n);
 }
 
 void
-socket_read(int s, struct event_addr *ea)
+socket_recvmmsg(int s, struct event_addr *ea)
+{
+	static __thread struct mmsghdr		 *mmsg;
+	static __thread struct iovec		 *iov;
+	static __thread union cmsgbuf		 *cmsgbuf;
+	static __thread struct event_addr	**ef;
+	struct event_addr	 *er;
+	struct msghdr		 *msg;
+	unsigned int		  i;
+	int			  n;
+
+	/*
+	 * Drain up to mmsg_number packets from the bound socket with
+	 * a single system call.  Every packet gets its own event
+	 * structure and control message buffer, so each response is
+	 * sent with the addresses of its own query.  Event structures
+	 * that are not filled are kept for the next call.
+	 */
+	if (mmsg == NULL) {
+		if ((mmsg = calloc(mmsg_number, sizeof(*mmsg))) == NULL)
+			err(1, "calloc");
+		if ((iov = calloc(mmsg_number * 2, sizeof(*iov))) == NULL)
+			err(1, "calloc");
+		if ((cmsgbuf = calloc(mmsg_number, sizeof(*cmsgbuf))) == NULL)
+			err(1, "calloc");
+		if ((ef = calloc(mmsg_number, sizeof(*ef))) == NULL)
+			err(1, "calloc");
+	}
+	for (i = 0; i < mmsg_number; i++) {
+		if (ef[i] == NULL)
+			ef[i] = pool_get(&worker->w_pool);
+		socket_rcviov(&iov[2 * i], &ef[i]->ea_hdr,
+		    sizeof(ef[i]->ea_hdr));
+		msg = &mmsg[i].msg_hdr;
+		msg->msg_name = &ef[i]->ea_fsa;
+		msg->msg_namelen = sizeof(ef[i]->ea_fsa);
+		msg->msg_iov = &iov[2 * i];
+		msg->msg_iovlen = 2;
+		msg->msg_control = &cmsgbuf[i].buf;
+		msg->msg_controllen = sizeof(cmsgbuf[i]);
+		msg->msg_flags = 0;
+	}
+
+	/* We have been woken up by libevent, at least one packet is there. */
+	if ((n = recvmmsg(s, mmsg, mmsg_number, MSG_DONTWAIT, NULL)) == -1) {
+		stat_inc(stat_rcverr);
+		return;
+	}
+	stat_inc(stat_rcvmmsg);
+	stat_add(stat_rcvbatch, n);
+
+	for (i = 0; i < (unsigned int)n; i++) {
+		stat_add(stat_rcvbytes, mmsg[i].msg_len);
+		ef[i]->ea_hdrlen = mmsg[i].msg_len < sizeof(ef[i]->ea_hdr) ?
+		    mmsg[i].msg_len : sizeof(ef[i]->ea_hdr);
+		socket_cmsg(&mmsg[i].msg_hdr, ef[i]);
+		if ((er = socket_query(s, ea, ef[i])) != NULL)
+			socket_delay(er);
+		ef[i] = NULL;
+	}
+}
+
+struct event_addr *
+socket_query(int s, struct event_addr *ea, struct event_addr *ef)
+{
+	/*
+	 * The event for the response has received the query packet.
+	 * The local address is the same as we used to bind the socket
+	 * where we received the packet.  The foreign address is taken
+	 * from the query packet.  The event structure is freed if the
+	 * response cannot be sent.  Return the event that sends the
+	 * response.
+	 */
+	ef->ea_family = ea->ea_family;
+	ef->ea_socktype = ea->ea_socktype;
+	ef->ea_protocol = ea->ea_protocol;
+	ef->ea_idle = 0;
+
+	if (connected) {
+		struct event_addr	*ec;
+		int			 optval;
+
+		/*
+		 * An idle cached socket may be connected to the same
+		 * foreign address.  Handle the query as if that socket
+		 * had received it.  A socket with a pending response
+		 * cannot take a second query, its header and timeout
+		 * would be overwritten.
+		 */
+		if (cache_size &&
+		    (ec = cache_lookup(ea, &ef->ea_fsa)) != NULL) {
+			stat_inc(stat_cachehit);
+			cache_wakeup(ec);
+			ec->ea_hdr = ef->ea_hdr;
+			ec->ea_hdrlen = ef->ea_hdrlen;
+			pool_put(&worker->w_pool, ef);
+			return (ec);
+		}
+
+		/*
+		 * We should use a connected socket, but received
+		 * the packet on the unconnected bind socket.  So
+		 * we need an additional socket.
+		 */
+		if ((s = socket(ea->ea_family, ea->ea_socktype,
+		    ea->ea_protocol)) == -1) {
+			if (errno == EMFILE) {
+				stat_inc(stat_error);
+				pool_put(&worker->w_pool, ef);
+				return (NULL);
+			}
+			err(1, "socket");
+		}
+		optval = 1;
+		if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
+		    &optval, sizeof(optval)) == -1)
+			err(1, "setsockopt reuseport");
+		if (bind(s, (struct sockaddr *)&ea->ea_lsa,
+		    ea->ea_lsalen) == -1)
+			err(1, "bind");
+		if (connect(s, (struct sockaddr *)&ef->ea_fsa,
+		    ef->ea_fsalen) == -1) {
+			if (errno == EADDRINUSE) {
+				stat_inc(stat_error);
+				if (close(s) == -1)
+					err(1, "close");
+				pool_put(&worker->w_pool, ef);
+				return (NULL);
+			}
+			err(1, "connect");
+		}
+		if (cache_size) {
+			stat_inc(stat_cachemiss);
+			ef->ea_listen = ea;
+			cache_insert(ef);
+		}
+	}
+	event_set(&ef->ea_event, s, connected ? EV_READ|EV_TIMEOUT :
+	    EV_TIMEOUT, socket_callback, ef);
+	event_base_set(worker->w_base, &ef->ea_event);
+	timer_set(&ef->ea_timer, s, socket_callback, ef);
+
+	stat_inc(stat_open);
+	return (ef);
+}
+
+void
+socket_delay(struct event_addr *ea)
 {
 	struct timeval	 to;
-	char		 rbuf[16];
+
+	stat_inc(stat_recv);
+	dist_timeval(&delay_dist, &to);
+	ea->ea_deadline = lag_deadline(&to);
+	if (timer_tick) {
+		if (connected)
+			event_add(&ea->ea_event, NULL);
+		timer_add(&ea->ea_timer, &to);
+	} else
+		event_add(&ea->ea_event, &to);
+}
+
+void
+socket_read(int s, struct event_addr *ea)
+{
+	struct iovec	 iov[2];
+	ssize_t		 n;
+	PROFILE_SCOPE(prof_read);
 
 	if (ea->ea_fsalen) {
 		/*
 		 * The socket is already conntect to the foreign address.
-		 * Just read the packet.
+		 * Just read the packet.  An idle cached socket is used
+		 * again.
 		 */
-		if (recv(s, rbuf, sizeof(rbuf), 0) == -1) {
-			stat_rcverr++;
+		if (ea->ea_idle) {
+			stat_inc(stat_cachehit);
+			cache_wakeup(ea);
+		}
+		socket_rcviov(iov, &ea->ea_hdr, sizeof(ea->ea_hdr));
+		if ((n = readv(s, iov, 2)) == -1) {
+			stat_inc(stat_rcverr);
+			if (cache_size)
+				cache_remove(ea);
 			if (close(s) == -1)
 				err(1, "close");
 			event_del(&ea->ea_event);
-			free(ea);
-			stat_open--;
+			timer_del(&ea->ea_timer);
+			pool_put(&worker->w_pool, ea);
+			stat_dec(stat_open);
 			return;
 		}
+		stat_add(stat_rcvbytes, n);
+		ea->ea_hdrlen = (size_t)n < sizeof(ea->ea_hdr) ?
+		    (size_t)n : sizeof(ea->ea_hdr);
+	} else if (mmsg_number > 1) {
+		socket_recvmmsg(s, ea);
+		return;
 	} else {
 		struct event_addr	*ef;
 
 		/*
-		 * Create an event that is used to send the resonse.  The
-		 * local address is the same as we used to bind the socket
-		 * where we received the packet.  The foreign address is
-		 * taken from the query packet.  The response gets delayed.
+		 * Create an event that is used to send the resonse.
+		 * The response gets delayed.
 		 */
-		if ((ef = malloc(sizeof(*ef))) == NULL)
-			err(1, "malloc");
-		ef->ea_family = ea->ea_family;
-		ef->ea_socktype = ea->ea_socktype;
-		ef->ea_protocol = ea->ea_protocol;
-
+		ef = pool_get(&worker->w_pool);
 		if (socket_recv(s, ef) == -1) {
-			stat_rcverr++;
-			free(ef);
+			stat_inc(stat_rcverr);
+			pool_put(&worker->w_pool, ef);
 			return;
 		}
-		if (connected) {
-			int	 optval;
-
-			/*
-			 * We should use a connected socket, but received
-			 * the packet on the unconnected bind socket.  So
-			 * we need an additional socket.
-			 */
-			if ((s = socket(ea->ea_family, ea->ea_socktype,
-			    ea->ea_protocol)) == -1) {
-				if (errno == EMFILE) {
-					stat_error++;
-					free(ef);
-					return;
-				}
-				err(1, "socket");
-			}
-			optval = 1;
-			if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
-			    &optval, sizeof(optval)) == -1)
-				err(1, "setsockopt reuseport");
-			if (bind(s, (struct sockaddr *)&ea->ea_lsa,
-			    ea->ea_lsalen) == -1)
-				err(1, "bind");
-			if (connect(s, (struct sockaddr *)&ef->ea_fsa,
-			    ef->ea_fsalen) == -1) {
-				if (errno == EADDRINUSE) {
-					stat_error++;
-					if (close(s) == -1)
-						err(1, "close");
-					free(ef);
-					return;
-				}
-				err(1, "connect");
-			}
-		}
-		event_set(&ef->ea_event, s, connected ? EV_READ|EV_TIMEOUT :
-		    EV_TIMEOUT, socket_callback, ef);
-
-		ea = ef;
-		stat_open++;
+		if ((ea = socket_query(s, ea, ef)) == NULL)
+			return;
 	}
 
-	stat_recv++;
-	to.tv_sec = arc4random_uniform(delay_bound);
-	to.tv_usec = 1 + arc4random_uniform(999999);
-	event_add(&ea->ea_event, &to);
+	socket_delay(ea);
 }
 
 void
 socket_write(int s, struct event_addr *ea)
 {
-	if (ea->ea_family == AF_INET && icmp_percentage &&
-	    icmp_percentage > arc4random_uniform(100)) {
-		icmp_send((struct sockaddr_in *)&ea->ea_lsa, ea->ea_lsalen,
-		    (struct sockaddr_in *)&ea->ea_fsa, ea->ea_fsalen);
+	const void	*hdr;
+	size_t		 hdrlen;
+	PROFILE_SCOPE(prof_write);
+
+	if (icmp_percentage && icmp_percentage > random_uniform(100)) {
+		icmp_send((struct sockaddr *)&ea->ea_lsa, ea->ea_lsalen,
+		    (struct sockaddr *)&ea->ea_fsa, ea->ea_fsalen);
 	} else {
+		/* Echo the query header, respond to others with bar. */
+		if (ea->ea_hdrlen == sizeof(ea->ea_hdr)) {
+			hdr = &ea->ea_hdr;
+			hdrlen = sizeof(ea->ea_hdr);
+		} else {
+			hdr = "bar\n";
+			hdrlen = 4;
+		}
 		if (connected)
-			socket_send(s, "bar\n", NULL, 0);
+			socket_send(s, hdr, hdrlen, NULL, 0);
+		else if (mmsg_number > 1)
+			socket_enqueue(s, hdr, hdrlen,
+			    (struct sockaddr *)&ea->ea_fsa, ea->ea_fsalen);
 		else
-			socket_send(s, "bar\n",
+			socket_send(s, hdr, hdrlen,
 			    (struct sockaddr *)&ea->ea_fsa, ea->ea_fsalen);
 	}
 }
@@ -310,63 +601,220 @@ void
 socket_callback(int s, short event, void *arg)
 {
 	struct event_addr	*ea = arg;
+	PROFILE_SCOPE(prof_callback);
 
 	if (event & EV_READ) {
 		socket_read(s, ea);
 	}
-	if (event & EV_TIMEOUT) {
+	if (event & EV_TIMEOUT)
+		lag_record(ea->ea_deadline);
+	if ((event & EV_TIMEOUT) && ea->ea_idle) {
+		/* The cached socket has not been used for linger time. */
+		stat_inc(stat_cacheexpire);
+		cache_close(ea);
+	} else if (event & EV_TIMEOUT) {
 		/*
 		 * The delay for the response is over.  Send it and
-		 * destroy the event structure.
+		 * destroy the event structure.  Keep a connected
+		 * socket in the cache.
 		 */
 		socket_write(s, ea);
-		if (connected) {
-			if (close(s) == -1)
-				err(1, "close");
+		stat_dec(stat_open);
+		if (cache_size)
+			cache_park(ea);
+		else {
+			if (connected) {
+				/*
+				 * The timer wheel does not remove the
+				 * read event.
+				 */
+				event_del(&ea->ea_event);
+				if (close(s) == -1)
+					err(1, "close");
+			}
+			pool_put(&worker->w_pool, ea);
 		}
-		free(ea);
-		stat_open--;
 	}
-	if (oneshot && stat_open == 0) {
+	if (oneshot && stat_get(stat_open) == 0) {
+		if (cache_size)
+			cache_flush();
 		for (ea = eladdr; ea->ea_lsalen; ea++)
 			event_del(&ea->ea_event);
 		free(eladdr);
-		if (icmp_percentage)
-			icmp_destroy();
-		statistic_destroy();
+		worker_done();
+	}
+}
+
+/*
+ * Cache of connected sockets per worker.  Sockets are hashed by the
+ * listen address they are bound to and the foreign address they are
+ * connected to.  After the response has been sent, the socket stays
+ * idle in the cache and receives further queries of the same client
+ * directly.  The least recently used idle socket is evicted if the
+ * cache is full, idle sockets are closed after the linger time.
+ */
+void
+cache_init(void)
+{
+	unsigned int	 n;
+
+	/* Pending responses and idle sockets are in the hash table. */
+	for (n = 1; n < socket_number + cache_size; n <<= 1)
+		continue;
+	if ((cache_table = calloc(n, sizeof(*cache_table))) == NULL)
+		err(1, "calloc");
+	cache_mask = n - 1;
+	TAILQ_INIT(&cache_lru);
+}
+
+struct cache_bucket *
+cache_bucket(const struct event_addr *el, const struct sockaddr_storage *fsa)
+{
+	const struct sockaddr_in	*sin;
+	const struct sockaddr_in6	*sin6;
+	const uint32_t			*a;
+	uint32_t			 h;
+
+	h = (uint32_t)(el - eladdr);
+	switch (fsa->ss_family) {
+	case AF_INET:
+		sin = (const struct sockaddr_in *)fsa;
+		h ^= sin->sin_addr.s_addr;
+		h = h * 0x9e3779b1 ^ sin->sin_port;
+		break;
+	case AF_INET6:
+		sin6 = (const struct sockaddr_in6 *)fsa;
+		a = (const uint32_t *)&sin6->sin6_addr;
+		h ^= a[0] ^ a[1] ^ a[2] ^ a[3];
+		h = h * 0x9e3779b1 ^ sin6->sin6_port;
+		break;
+	}
+	/* Mix the port into the low bits that select the bucket. */
+	h *= 0x85ebca6b;
+	h ^= h >> 16;
+	return (&cache_table[h & cache_mask]);
+}
+
+struct event_addr *
+cache_lookup(const struct event_addr *el, const struct sockaddr_storage *fsa)
+{
+	struct event_addr	*ea;
+
+	/* Only idle sockets can take the query. */
+	LIST_FOREACH(ea, cache_bucket(el, fsa), ea_hash) {
+		if (!ea->ea_idle || ea->ea_listen != el ||
+		    ea->ea_fsa.ss_family != fsa->ss_family)
+			continue;
+		switch (fsa->ss_family) {
+		case AF_INET:
+			if (memcmp(&((struct sockaddr_in *)&ea->ea_fsa)->
+			    sin_addr, &((const struct sockaddr_in *)fsa)->
+			    sin_addr, sizeof(struct in_addr)) == 0 &&
+			    ((struct sockaddr_in *)&ea->ea_fsa)->sin_port ==
+			    ((const struct sockaddr_in *)fsa)->sin_port)
+				return (ea);
+			break;
+		case AF_INET6:
+			if (memcmp(&((struct sockaddr_in6 *)&ea->ea_fsa)->
+			    sin6_addr, &((const struct sockaddr_in6 *)fsa)->
+			    sin6_addr, sizeof(struct in6_addr)) == 0 &&
+			    ((struct sockaddr_in6 *)&ea->ea_fsa)->sin6_port ==
+			    ((const struct sockaddr_in6 *)fsa)->sin6_port)
+				return (ea);
+			break;
+		}
+	}
+	return (NULL);
+}
+
+void
+cache_insert(struct event_addr *ea)
+{
+	LIST_INSERT_HEAD(cache_bucket(ea->ea_listen, &ea->ea_fsa), ea,
+	    ea_hash);
+}
+
+void
+cache_remove(struct event_addr *ea)
+{
+	LIST_REMOVE(ea, ea_hash);
+	if (ea->ea_idle) {
+		TAILQ_REMOVE(&cache_lru, ea, ea_lru);
+		ea->ea_idle = 0;
+		stat_dec(stat_cached);
 	}
 }
 
+void
+cache_wakeup(struct event_addr *ea)
+{
+	/*
+	 * The idle socket gets a pending response again.  Its events
+	 * are rearmed when the response is delayed.
+	 */
+	if (!ea->ea_idle)
+		return;
+	TAILQ_REMOVE(&cache_lru, ea, ea_lru);
+	ea->ea_idle = 0;
+	stat_dec(stat_cached);
+	stat_inc(stat_open);
+}
+
+void
+cache_park(struct event_addr *ea)
+{
+	struct timeval	 to;
+
+	if (stat_get(stat_cached) >= cache_size) {
+		stat_inc(stat_cacheevict);
+		cache_close(TAILQ_FIRST(&cache_lru));
+	}
+	ea->ea_idle = 1;
+	TAILQ_INSERT_TAIL(&cache_lru, ea, ea_lru);
+	stat_inc(stat_cached);
+
+	/* Wait for the next query or close after the linger time. */
+	to.tv_sec = cache_linger;
+	to.tv_usec = 0;
+	ea->ea_deadline = lag_deadline(&to);
+	if (timer_tick) {
+		event_add(&ea->ea_event, NULL);
+		timer_add(&ea->ea_timer, &to);
+	} else
+		event_add(&ea->ea_event, &to);
+}
+
+void
+cache_close(struct event_addr *ea)
+{
+	cache_remove(ea);
+	event_del(&ea->ea_event);
+	timer_del(&ea->ea_timer);
+	if (close(EVENT_FD(&ea->ea_event)) == -1)
+		err(1, "close");
+	pool_put(&worker->w_pool, ea);
+}
+
+void
+cache_flush(void)
+{
+	struct event_addr	*ea;
+
+	while ((ea = TAILQ_FIRST(&cache_lru)) != NULL)
+		cache_close(ea);
+}
+
 void
 socket_init(void)
 {
 	struct event_addr	*ea;
 	struct addrinfo		 hints, *res, *res0;
-	const char		*cause = NULL;
-	const struct sockaddr	**lsa;
-	socklen_t		*lsalen;
-	int			*sfamily, *socktype, *protocol;
-	int			*s;
-	int			 optval = 1;
-	int			 error, save_errno;
-	unsigned int		 nsock, n;
+	int			 error;
 
 	/*
-	 * Create sockets and bind them for all suitable addresses.
+	 * Remember all suitable addresses.  Every worker creates its
+	 * own sockets and binds them to these addresses.
 	 */
-	if ((s = calloc(socket_number, sizeof(*s))) == NULL)
-		err(1, "calloc");
-	if ((lsa = calloc(socket_number, sizeof(*lsa))) == NULL)
-		err(1, "calloc");
-	if ((lsalen = calloc(socket_number, sizeof(*lsalen))) == NULL)
-		err(1, "calloc");
-	if ((sfamily = calloc(socket_number, sizeof(*sfamily))) == NULL)
-		err(1, "calloc");
-	if ((socktype = calloc(socket_number, sizeof(*socktype))) == NULL)
-		err(1, "calloc");
-	if ((protocol = calloc(socket_number, sizeof(*protocol))) == NULL)
-		err(1, "calloc");
-
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = family;
 	hints.ai_socktype = SOCK_DGRAM;
@@ -376,90 +824,119 @@ socket_init(void)
 	if (error)
 		errx(1, "getaddrinfo host %s, port %s: %s",
 		    host, port, gai_strerror(error));
-	nsock = 0;
-	for (res = res0; res && nsock < socket_number; res = res->ai_next) {
-		s[nsock] = socket(res->ai_family, res->ai_socktype,
-		    res->ai_protocol);
-		if (s[nsock] == -1) {
+	if ((ea = ealisten = calloc(socket_number + 1, sizeof(*ea))) == NULL)
+		err(1, "calloc");
+	for (res = res0; res && nlisten < socket_number; res = res->ai_next) {
+		if (res->ai_addrlen > sizeof(ea->ea_lsa))
+			err(1, "getaddrinfo: addrlen %u too big",
+			    res->ai_addrlen);
+		memcpy(&ea->ea_lsa, res->ai_addr, res->ai_addrlen);
+		ea->ea_lsalen = res->ai_addrlen;
+		ea->ea_family = res->ai_family;
+		ea->ea_socktype = res->ai_socktype;
+		ea->ea_protocol = res->ai_protocol;
+		ea++;
+		nlisten++;
+	}
+	freeaddrinfo(res0);
+	if (verbose) {
+		printf("%s event method %s\n",
+		    getprogname(), event_get_method());
+		printf("%s random seed %llu\n",
+		    getprogname(), (unsigned long long)random_seed);
+	}
+}
+
+void
+socket_worker(void)
+{
+	struct event_addr	*ea, *el;
+	const char		*cause = NULL;
+	char			 laddress[NI_MAXHOST], lservice[NI_MAXSERV];
+	int			 s;
+	int			 optval = 1;
+	int			 error, save_errno;
+
+	/*
+	 * Create sockets and bind them for all suitable addresses.
+	 * Create an event structure for every socket that has been bound
+	 * to an address.  Wait to receive packets on these sockets.
+	 * The pending responses are allocated from a pool.
+	 */
+	if ((ea = eladdr = calloc(nlisten + 1, sizeof(*ea))) == NULL)
+		err(1, "calloc");
+	pool_init(&worker->w_pool, sizeof(struct event_addr),
+	    socket_number + cache_size);
+	if (cache_size)
+		cache_init();
+	for (el = ealisten; el->ea_lsalen; el++) {
+		s = socket(el->ea_family, el->ea_socktype, el->ea_protocol);
+		if (s == -1) {
 			cause = "socket";
 			continue;
 		}
-		switch (res->ai_family) {
+		switch (el->ea_family) {
 		case AF_INET:
-			if (setsockopt(s[nsock], IPPROTO_IP, IP_RECVDSTADDR,
+			if (setsockopt(s, IPPROTO_IP, IP_RECVDSTADDR,
 			    &optval, sizeof(optval)) == -1)
 				err(1, "setsockopt recvdstaddr");
-			if (setsockopt(s[nsock], IPPROTO_IP, IP_RECVDSTPORT,
+			if (setsockopt(s, IPPROTO_IP, IP_RECVDSTPORT,
 			    &optval, sizeof(optval)) == -1)
 				err(1, "setsockopt recvdstport");
 			break;
 		case AF_INET6:
-			if (setsockopt(s[nsock], IPPROTO_IPV6, IPV6_RECVPKTINFO,
+			if (setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO,
 			    &optval, sizeof(optval)) == -1)
 				err(1, "setsockopt recvpktinfo6");
-			if (setsockopt(s[nsock], IPPROTO_IPV6, IPV6_RECVDSTPORT,
+			if (setsockopt(s, IPPROTO_IPV6, IPV6_RECVDSTPORT,
 			    &optval, sizeof(optval)) == -1)
 				err(1, "setsockopt recvdstport6");
 			break;
 		}
 
-		error = getnameinfo(res->ai_addr, res->ai_addrlen,
-		    laddress, sizeof(laddress), lservice, sizeof(lservice),
+		error = getnameinfo((struct sockaddr *)&el->ea_lsa,
+		    el->ea_lsalen, laddress, sizeof(laddress),
+		    lservice, sizeof(lservice),
 		    NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
 		if (error)
 			errx(1, "getnameinfo local: %s", gai_strerror(error));
 
-		if (connected) {
-			if (setsockopt(s[nsock], SOL_SOCKET, SO_REUSEPORT,
+		/*
+		 * Connected sockets and the bind sockets of all workers
+		 * share the local address.  Linux hashes the incoming
+		 * packets over the bind sockets.  OpenBSD passes them all
+		 * to the first matching socket, so one worker receives
+		 * the new flows.  Connected sockets get their own flow.
+		 */
+		if (connected || worker_number > 1) {
+			if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
 			    &optval, sizeof(optval)) == -1)
 				err(1, "setsockopt reuseport");
 		}
-		if (bind(s[nsock], res->ai_addr, res->ai_addrlen) == -1) {
+		if (bind(s, (struct sockaddr *)&el->ea_lsa,
+		    el->ea_lsalen) == -1) {
 			cause = "bind";
 			save_errno = errno;
-			if (close(s[nsock]) == -1)
+			if (close(s) == -1)
 				err(1, "close");
 			errno = save_errno;
 			continue;
 		}
 
-		if (verbose)
+		if (verbose && worker == workers)
 			printf("%s local address %s, service %s\n",
 			    getprogname(), laddress, lservice);
-		lsa[nsock] = res->ai_addr;
-		lsalen[nsock] = res->ai_addrlen;
-		sfamily[nsock] = res->ai_family;
-		socktype[nsock] = res->ai_socktype;
-		protocol[nsock] = res->ai_protocol;
-		nsock++;
-	}
-	if (nsock == 0)
-		err(1, "%s local address %s, service %s",
-		    cause, laddress, lservice);
-
-	/*
-	 * Create an event structure for every socket that has been bound
-	 * to an address.  Wait to receive packets on these sockets.
-	 */
-	if ((ea = eladdr = calloc(nsock + 1, sizeof(*ea))) == NULL)
-		err(1, "calloc");
-	for (n = 0; n < nsock; n++, ea++) {
-		event_set(&ea->ea_event, s[n], EV_READ|EV_PERSIST,
+		memcpy(&ea->ea_lsa, &el->ea_lsa, el->ea_lsalen);
+		ea->ea_lsalen = el->ea_lsalen;
+		ea->ea_family = el->ea_family;
+		ea->ea_socktype = el->ea_socktype;
+		ea->ea_protocol = el->ea_protocol;
+		event_set(&ea->ea_event, s, EV_READ|EV_PERSIST,
 		    socket_callback, ea);
-		if (lsalen[n] > sizeof(ea->ea_lsa))
-			err(1, "getaddrinfo: addrlen %u too big", lsalen[n]);
-		memcpy(&ea->ea_lsa, lsa[n], lsalen[n]);
-		ea->ea_lsalen = lsalen[n];
-		ea->ea_family = sfamily[n];
-		ea->ea_socktype = socktype[n];
-		ea->ea_protocol = protocol[n];
+		event_base_set(worker->w_base, &ea->ea_event);
 		event_add(&ea->ea_event, NULL);
+		ea++;
 	}
-	free(s);
-	free(lsa);
-	free(lsalen);
-	free(sfamily);
-	free(socktype);
-	free(protocol);
-	freeaddrinfo(res0);
+	if (ea == eladdr)
+		err(1, "%s host %s, port %s", cause, host ? host : "*", port);
 }
@@ -14,55 +14,153 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/mman.h>
+#include <sys/queue.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
 #include <netinet/udp.h>
+#ifdef SO_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
 
+#if (defined(__amd64__) || defined(__i386__)) && defined(__GNUC__)
+#define CKSUM_X86
+#include <immintrin.h>
+#endif
+
+#include <ctype.h>
 #include <err.h>
+#include <errno.h>
 #include <event.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "util.h"
 
 void	 droppriv(void);
-int	 in_cksum(const void *, size_t);
+int	 in_cksum_wide(const void *, size_t);
+#ifdef CKSUM_X86
+int	 in_cksum_sse2(const void *, size_t);
+int	 in_cksum_avx2(const void *, size_t);
+#endif
 void	 icmp_callback(int, short, void *);
-void	 statistic_callback(int, short, void *);
+void	 icmp_flush(int, short, void *);
+void	 icmp6_template(void);
+void	 dist_table(struct distribution *);
+void	 dist_alias(struct distribution *);
+void	 worker_init(void);
+void	 worker_start(void);
+void	*worker_thread(void *);
+void	 worker_callback(int, short, void *);
+void	 worker_destroy(void);
+void	 timer_insert(struct timer *);
+void	 timer_cascade(struct timer_list *);
+void	 timer_callback(int, short, void *);
+void	 socket_msghdr(struct msghdr *, struct iovec *, const void *,
+	    size_t, struct sockaddr *, size_t);
+void	 socket_sendmmsg(int, struct mmsghdr *, unsigned int);
+void	 socket_flush(int, short, void *);
+void	 shm_callback(int, short, void *);
+void	 statistic_text(const uint64_t *, const uint64_t *,
+	    const struct histogram *, const struct histogram *, short);
+void	 statistic_json(uint64_t, uint64_t, const uint64_t *,
+	    const uint64_t *, const struct histogram *,
+	    const struct histogram *);
+void	 statistic_csv(uint64_t, uint64_t, const uint64_t *,
+	    const uint64_t *, const struct histogram *,
+	    const struct histogram *);
+double	 statistic_rate(uint64_t, uint64_t);
+void	 statistic_rusage(uint64_t *, uint64_t *);
+void	 lag_init(void);
+void	 lag_callback(int, short, void *);
 
 struct event_base	*eb;
 struct event		 evicmp;
+struct event		 evicmp6;
 struct event		 evstat;
+struct event		 evlag;
+__thread struct event	 evflush;
+struct event		 evdone;
+struct event		 evshm;
 int			 sicmp;
+int			 sicmp6 = -1;
 unsigned int		 icmp_percentage;
+unsigned int		 icmp_type = ICMP_UNREACH;
+unsigned int		 icmp_code = ICMP_UNREACH_FILTER_PROHIB;
+unsigned int		 icmp_quote;
+char			 icmp_packet[ICMP_PACKETMAX];
+size_t			 icmp_len;
+char			 icmp6_packet[ICMP_PACKETMAX];
+size_t			 icmp6_len;
 unsigned int		 socket_number = 1000;;
 unsigned int		 payload_bound;
+unsigned int		 mmsg_number = 1;
+unsigned int		 worker_number = 1;
+unsigned int		 worker_running;
+unsigned int		 timer_tick;
+unsigned int		 send_rate;
+unsigned int		 cache_size;
+unsigned int		 recycle_percentage;
+uint32_t		 lag_threshold;
+int			 udp_offload;
+int			 zerocopy;
+uint64_t		 random_seed;
+enum dist_type		 dist_type = dist_uniform;
+uint32_t		 dist_mean;
+double			 dist_shape = 1.16;
+const char		*dist_file;
+int			 random_seeded;
+int			 flow_statistics;
+int			 worker_pipe[2];
 int			 statistics;
-unsigned int		 stat_open, stat_send, stat_snderr,
-			 stat_recv, stat_rcverr, stat_error,
-			 stat_sndicmp, stat_rcvicmp;
+int			 verbose;
+enum stat_format	 stat_format = format_text;
+const char		*stat_file;
+FILE			*stat_fp;
+const char		*shm_file;
+const char		*method_name;
+struct stat_shm		*shm;
+const struct cksum_method *cksum_method = &cksum_methods[1];
+char			*payload;
+struct worker		*workers;
+__thread struct worker	*worker;
 
 int
 main(int argc, char *argv[])
 {
 	struct rlimit	 rlim;
+	rlim_t		 nfiles;
 
 	setopt(argc, argv);
+	cksum_init();
+	icmp_template();
 
+	/* Closed zero copy sockets linger while buffers are busy. */
+	nfiles = socket_number + cache_size * worker_number + 10;
+	if (zerocopy)
+		nfiles += ZEROCOPY_BUFFERS * worker_number;
 	if (getrlimit(RLIMIT_NOFILE, &rlim) == -1)
 		err(1, "getrlimit number of open files");
-	if (rlim.rlim_cur < socket_number + 10) {
-		rlim.rlim_cur = socket_number + 10;
+	if (rlim.rlim_cur < nfiles) {
+		rlim.rlim_cur = nfiles;
 		if (setrlimit(RLIMIT_NOFILE, &rlim) == -1)
 			err(1, "setrlimit number of open files to %llu",
 			    rlim.rlim_cur);
@@ -70,10 +168,21 @@ main(int argc, char *argv[])
 
 	if ((eb = event_init()) == NULL)
 		err(1, "event_init");
+	if (method_name && strcmp(event_get_method(), method_name) != 0)
+		errx(1, "event method %s not available, using %s",
+		    method_name, event_get_method());
+	worker_init();
+#ifdef PROFILE
+	prof_init();
+#endif
+	if (payload_bound) {
+		if ((payload = calloc(payload_bound, 1)) == NULL)
+			err(1, "calloc");
+	}
 
 	/*
-	 * Create a raw socket to send and receive icmp error packets.
-	 * XXX IPv6 is not implemented.
+	 * Create raw sockets to send and receive icmp error packets
+	 * for IPv4 and IPv6.
 	 */
 	if (icmp_percentage)
 		icmp_init();
@@ -86,15 +195,62 @@ main(int argc, char *argv[])
 	 */
 	socket_init();
 
+	/*
+	 * Start a thread with its own event loop for every additional
+	 * worker.  The main thread is the first worker.
+	 */
+	worker_start();
+	if (timer_tick)
+		timer_init();
+	socket_worker();
+
 	/*
 	 * Print statistic information periodically or at siginfo.
+	 * Export it to shared memory for external monitoring.
 	 */
 	statistic_init();
+	if (shm_file)
+		shm_init();
+	if (lag_threshold)
+		lag_init();
 
 	event_dispatch();
+	worker_destroy();
 	return (0);
 }
 
+/*
+ * Libevent selects the kernel notification mechanism when the event
+ * base is created.  It skips every method that has its EVENT_NO
+ * environment variable set.  Disable all methods but the requested
+ * one, so the engines can be compared with the same program logic.
+ */
+void
+event_method(const char *name)
+{
+	static const char	*methods[] = {
+		"kqueue", "epoll", "devpoll", "evport", "poll", "select"
+	};
+	char			 env[32], *p;
+	unsigned int		 i;
+	int			 found = 0;
+
+	for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+		if (strcmp(name, methods[i]) == 0) {
+			found = 1;
+			continue;
+		}
+		snprintf(env, sizeof(env), "EVENT_NO%s", methods[i]);
+		for (p = env; *p != '\0'; p++)
+			*p = toupper((unsigned char)*p);
+		if (setenv(env, "1", 1) == -1)
+			err(1, "setenv %s", env);
+	}
+	if (!found)
+		errx(1, "unknown event method: %s", name);
+	method_name = name;
+}
+
 void
 droppriv(void)
 {
@@ -123,56 +279,446 @@ droppriv(void)
 void
 icmp_init(void)
 {
+	struct icmp6_filter	 filter;
+
 	if ((sicmp = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP)) == -1)
 		err(1, "socket icmp");
 	event_set(&evicmp, sicmp, EV_READ|EV_PERSIST, icmp_callback, &evicmp);
 	event_add(&evicmp, NULL);
+
+	/*
+	 * Without IPv6 support in the kernel there are no IPv6 flows
+	 * that need errors.  Only count the destination unreachable
+	 * errors, neighbor discovery would disturb the statistics.
+	 */
+	if ((sicmp6 = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) == -1) {
+		if (errno == EAFNOSUPPORT || errno == EPROTONOSUPPORT)
+			return;
+		err(1, "socket icmp6");
+	}
+	ICMP6_FILTER_SETBLOCKALL(&filter);
+	ICMP6_FILTER_SETPASS(ICMP6_DST_UNREACH, &filter);
+	if (setsockopt(sicmp6, IPPROTO_ICMPV6, ICMP6_FILTER, &filter,
+	    sizeof(filter)) == -1)
+		err(1, "setsockopt ICMP6_FILTER");
+	event_set(&evicmp6, sicmp6, EV_READ|EV_PERSIST, icmp_callback,
+	    &evicmp6);
+	event_add(&evicmp6, NULL);
+}
+
+/*
+ * The internet checksum is the ones complement sum of 16 bit words.
+ * Summing larger words and folding the carries at the end gives the
+ * same result in any byte order, see RFC 1071.  An odd last byte is
+ * padded with zero.
+ */
+static inline uint64_t
+cksum_fold(uint64_t sum)
+{
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return (sum);
 }
 
+static inline int
+cksum_tail(uint64_t sum, const unsigned char *p, size_t len)
+{
+	uint32_t	 w32;
+	uint16_t	 w16 = 0;
+
+	while (len >= sizeof(w32)) {
+		memcpy(&w32, p, sizeof(w32));
+		sum += w32;
+		p += sizeof(w32);
+		len -= sizeof(w32);
+	}
+	if (len >= sizeof(w16)) {
+		memcpy(&w16, p, sizeof(w16));
+		sum += w16;
+		p += sizeof(w16);
+		len -= sizeof(w16);
+	}
+	if (len) {
+		w16 = 0;
+		memcpy(&w16, p, 1);
+		sum += w16;
+	}
+	return (~cksum_fold(sum) & 0xffff);
+}
+
+/* Reference implementation, one 16 bit word at a time. */
 int
-in_cksum(const void *buf, size_t len)
+in_cksum_scalar(const void *buf, size_t len)
 {
-	int sum = 0;
+	const unsigned char	*p = buf;
+	uint32_t		 sum = 0;
+	uint16_t		 w;
 
-	while (len) {
-		sum += *(const u_int16_t *)buf;
+	for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		sum += w;
+		if (sum > 0xffff)
+			sum = (sum >> 16) + (sum & 0xffff);
+	}
+	if (len) {
+		w = 0;
+		memcpy(&w, p, 1);
+		sum += w;
 		if (sum > 0xffff)
 			sum = (sum >> 16) + (sum & 0xffff);
-		buf = (const u_int16_t *)buf + 1;
-		len -= sizeof(u_int16_t);
 	}
 	return (~sum & 0xffff);
 }
 
+/*
+ * Add 32 bit words to a 64 bit accumulator.  It cannot overflow
+ * before 16 GB of data, so the carries are folded once at the end.
+ */
+int
+in_cksum_wide(const void *buf, size_t len)
+{
+	const unsigned char	*p = buf;
+	uint64_t		 sum = 0;
+	uint32_t		 w[4];
+
+	for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+		memcpy(w, p, sizeof(w));
+		sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+	}
+	return (cksum_tail(sum, p, len));
+}
+
+#ifdef CKSUM_X86
+/*
+ * Zero extend 32 bit words into 64 bit lanes and add them.  The
+ * order of the words does not matter for the sum.
+ */
+__attribute__((__target__("sse2")))
+int
+in_cksum_sse2(const void *buf, size_t len)
+{
+	const unsigned char	*p = buf;
+	__m128i			 v, zero, acc;
+	uint64_t		 lane[2];
+
+	zero = _mm_setzero_si128();
+	acc = zero;
+	for (; len >= sizeof(v); p += sizeof(v), len -= sizeof(v)) {
+		v = _mm_loadu_si128((const __m128i *)(const void *)p);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+	}
+	_mm_storeu_si128((__m128i *)(void *)lane, acc);
+	return (cksum_tail(lane[0] + lane[1], p, len));
+}
+
+__attribute__((__target__("avx2")))
+int
+in_cksum_avx2(const void *buf, size_t len)
+{
+	const unsigned char	*p = buf;
+	__m256i			 v, zero, acc;
+	uint64_t		 lane[4];
+
+	zero = _mm256_setzero_si256();
+	acc = zero;
+	for (; len >= sizeof(v); p += sizeof(v), len -= sizeof(v)) {
+		v = _mm256_loadu_si256((const __m256i *)(const void *)p);
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+	}
+	_mm256_storeu_si256((__m256i *)(void *)lane, acc);
+	return (cksum_tail(lane[0] + lane[1] + lane[2] + lane[3], p, len));
+}
+#endif /* CKSUM_X86 */
+
+/*
+ * Checksum implementations from slowest to fastest.  The cpu feature
+ * is checked at runtime, the best supported one is used.
+ */
+const struct cksum_method cksum_methods[] = {
+	{ "scalar",	NULL,	in_cksum_scalar },
+	{ "wide",	NULL,	in_cksum_wide },
+#ifdef CKSUM_X86
+	{ "sse2",	"sse2",	in_cksum_sse2 },
+	{ "avx2",	"avx2",	in_cksum_avx2 },
+#endif
+	{ NULL,		NULL,	NULL }
+};
+
+int
+cksum_supported(const struct cksum_method *cm)
+{
+	if (cm->cm_cpu == NULL)
+		return (1);
+#ifdef CKSUM_X86
+	__builtin_cpu_init();
+	if (strcmp(cm->cm_cpu, "sse2") == 0)
+		return (__builtin_cpu_supports("sse2"));
+	if (strcmp(cm->cm_cpu, "avx2") == 0)
+		return (__builtin_cpu_supports("avx2"));
+#endif
+	return (0);
+}
+
 void
-icmp_send(struct sockaddr_in *lsa, socklen_t lsalen,
-    struct sockaddr_in *fsa, socklen_t fsalen)
+cksum_init(void)
 {
-	char		 packet[ICMP_MINLEN + sizeof(struct ip) +
-			    sizeof(struct udphdr)];
-	struct icmp	*icmp = (struct icmp *)packet;
-	struct ip	*ip = (struct ip *)(packet + ICMP_MINLEN);
+	const struct cksum_method	*cm;
+
+	for (cm = cksum_methods; cm->cm_name != NULL; cm++) {
+		if (cksum_supported(cm))
+			cksum_method = cm;
+	}
+}
+
+int
+in_cksum(const void *buf, size_t len)
+{
+	return (cksum_method->cm_func(buf, len));
+}
+
+/*
+ * Parse the icmp error type and code, e.g. 3:13 for unreachable
+ * administratively prohibited.
+ */
+void
+icmp_typecode(const char *arg)
+{
+	const char	*errstr;
+	char		*str, *code;
+
+	if ((str = strdup(arg)) == NULL)
+		err(1, "strdup");
+	if ((code = strchr(str, ':')) == NULL)
+		errx(1, "icmp type and code need colon: %s", arg);
+	*code++ = '\0';
+	icmp_type = strtonum(str, 0, 255, &errstr);
+	if (errstr)
+		errx(1, "icmp type is %s: %s", errstr, str);
+	icmp_code = strtonum(code, 0, 255, &errstr);
+	if (errstr)
+		errx(1, "icmp code is %s: %s", errstr, code);
+	free(str);
+}
+
+/*
+ * All icmp errors are equal but the quoted addresses and ports of
+ * the flow.  Build the packet once with these fields zero, the
+ * quoted payload is also zero.
+ */
+void
+icmp_template(void)
+{
+	struct icmp	*icmp = (struct icmp *)icmp_packet;
+	struct ip	*ip = (struct ip *)(icmp_packet + ICMP_MINLEN);
 	struct udphdr	*udp = (struct udphdr *)(ip + 1);
 
-	memset(packet, 0, sizeof(packet));
-	icmp = (struct icmp *)packet;
-	icmp->icmp_type = ICMP_UNREACH;
-	icmp->icmp_code = ICMP_UNREACH_FILTER_PROHIB;
+	icmp_len = ICMP_HDRLEN + icmp_quote;
+	memset(icmp_packet, 0, sizeof(icmp_packet));
+	icmp->icmp_type = icmp_type;
+	icmp->icmp_code = icmp_code;
 	ip->ip_v = 4;
 	ip->ip_hl = sizeof(struct ip) >> 2;
-	ip->ip_len = htons(sizeof(struct ip) + sizeof(struct udphdr));
+	ip->ip_len = htons(sizeof(struct ip) + sizeof(struct udphdr) +
+	    icmp_quote);
 	ip->ip_p = IPPROTO_UDP;
+	udp->uh_ulen = htons(sizeof(struct udphdr) + icmp_quote);
+	icmp->icmp_cksum = in_cksum(icmp_packet, icmp_len);
+
+	icmp6_template();
+}
+
+/*
+ * The kernel computes the ICMPv6 checksum of raw sockets, RFC 3542,
+ * so the template leaves it zero.
+ */
+void
+icmp6_template(void)
+{
+	struct icmp6_hdr	*icmp6 = (struct icmp6_hdr *)icmp6_packet;
+	struct ip6_hdr		*ip6 = (struct ip6_hdr *)(icmp6 + 1);
+	struct udphdr		*udp = (struct udphdr *)(ip6 + 1);
+
+	icmp6_len = ICMP6_HDRLEN + icmp_quote;
+	memset(icmp6_packet, 0, sizeof(icmp6_packet));
+	icmp6->icmp6_type = ICMP6_DST_UNREACH;
+	icmp6->icmp6_code = ICMP6_DST_UNREACH_ADMIN;
+	ip6->ip6_vfc = IPV6_VERSION;
+	ip6->ip6_plen = htons(sizeof(struct udphdr) + icmp_quote);
+	ip6->ip6_nxt = IPPROTO_UDP;
+	ip6->ip6_hlim = 64;
+	udp->uh_ulen = htons(sizeof(struct udphdr) + icmp_quote);
+}
+
+/*
+ * Construct an icmp error that quotes the header of the udp packet
+ * from the peer.  Copy the template and patch the flow.  As the
+ * patched fields were zero, the checksum is updated by adding them,
+ * HC' = ~(~HC + m') from RFC 1624.  The packet buffer has
+ * ICMP_PACKETMAX bytes.
+ */
+size_t
+icmp_build(char *packet, const struct sockaddr_in *lsa,
+    const struct sockaddr_in *fsa)
+{
+	struct icmp	*icmp = (struct icmp *)packet;
+	struct ip	*ip = (struct ip *)(packet + ICMP_MINLEN);
+	struct udphdr	*udp = (struct udphdr *)(ip + 1);
+	uint32_t	 sum;
+
+	memcpy(packet, icmp_packet, icmp_len);
 	ip->ip_src = fsa->sin_addr;
 	ip->ip_dst = lsa->sin_addr;
 	udp->uh_sport = fsa->sin_port;
 	udp->uh_dport = lsa->sin_port;
-	udp->uh_ulen = htons(sizeof(struct udphdr));
-	icmp->icmp_cksum = in_cksum(packet, sizeof(packet));
 
-	if (sendto(sicmp, packet, sizeof(packet), 0,
-	    (struct sockaddr *)fsa, fsalen) == -1)
-		err(1, "sendto icmp");
-	stat_sndicmp++;
+	sum = (uint16_t)~icmp->icmp_cksum;
+	sum += (fsa->sin_addr.s_addr >> 16) + (fsa->sin_addr.s_addr & 0xffff);
+	sum += (lsa->sin_addr.s_addr >> 16) + (lsa->sin_addr.s_addr & 0xffff);
+	sum += fsa->sin_port + lsa->sin_port;
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	icmp->icmp_cksum = ~sum;
+	return (icmp_len);
+}
+
+/* Only the quoted flow is patched, the kernel does the checksum. */
+size_t
+icmp6_build(char *packet, const struct sockaddr_in6 *lsa,
+    const struct sockaddr_in6 *fsa)
+{
+	struct icmp6_hdr	*icmp6 = (struct icmp6_hdr *)packet;
+	struct ip6_hdr		*ip6 = (struct ip6_hdr *)(icmp6 + 1);
+	struct udphdr		*udp = (struct udphdr *)(ip6 + 1);
+
+	memcpy(packet, icmp6_packet, icmp6_len);
+	ip6->ip6_src = fsa->sin6_addr;
+	ip6->ip6_dst = lsa->sin6_addr;
+	udp->uh_sport = fsa->sin6_port;
+	udp->uh_dport = lsa->sin6_port;
+	return (icmp6_len);
+}
+
+/*
+ * Errors that are due in the same event loop iteration are collected
+ * per worker and address family like the responses.  A zero timeout
+ * sends them with one sendmmsg system call on the raw socket.
+ */
+struct icmp_queue {
+	struct mmsghdr		*iq_mmsg;
+	struct iovec		*iq_iov;
+	char			(*iq_packet)[ICMP_PACKETMAX];
+	struct sockaddr_storage	*iq_addr;
+	struct event		 iq_flush;
+	unsigned int		 iq_count;
+	int			 iq_family;
+};
+
+__thread struct icmp_queue	 icmp_queue4 = { .iq_family = AF_INET };
+__thread struct icmp_queue	 icmp_queue6 = { .iq_family = AF_INET6 };
+
+void
+icmp_send(struct sockaddr *lsa, socklen_t lsalen, struct sockaddr *fsa,
+    socklen_t fsalen)
+{
+	struct icmp_queue	*iq;
+	struct sockaddr_storage	*addr;
+	struct msghdr		*msg;
+	char			*packet;
+	size_t			 len;
+	PROFILE_SCOPE(prof_icmp);
+
+	switch (fsa->sa_family) {
+	case AF_INET:
+		iq = &icmp_queue4;
+		break;
+	case AF_INET6:
+		/* Without an icmp6 socket the error cannot be sent. */
+		if (sicmp6 == -1) {
+			stat_inc(stat_error);
+			return;
+		}
+		iq = &icmp_queue6;
+		break;
+	default:
+		errx(1, "icmp_send: unknown address family %d",
+		    fsa->sa_family);
+	}
+	if (iq->iq_mmsg == NULL) {
+		if ((iq->iq_mmsg = calloc(ICMP_BATCH, sizeof(*iq->iq_mmsg)))
+		    == NULL)
+			err(1, "calloc");
+		if ((iq->iq_iov = calloc(ICMP_BATCH, sizeof(*iq->iq_iov)))
+		    == NULL)
+			err(1, "calloc");
+		if ((iq->iq_packet = calloc(ICMP_BATCH,
+		    sizeof(*iq->iq_packet))) == NULL)
+			err(1, "calloc");
+		if ((iq->iq_addr = calloc(ICMP_BATCH, sizeof(*iq->iq_addr)))
+		    == NULL)
+			err(1, "calloc");
+		evtimer_set(&iq->iq_flush, icmp_flush, iq);
+		event_base_set(worker->w_base, &iq->iq_flush);
+	}
+	if (iq->iq_count == ICMP_BATCH)
+		icmp_flush(-1, EV_TIMEOUT, iq);
+	if (fsalen > sizeof(*iq->iq_addr))
+		errx(1, "icmp_send: addrlen %u too big", fsalen);
+
+	/*
+	 * The port of a raw socket address is the protocol, some
+	 * kernels reject it otherwise.  Clear the udp port of the peer.
+	 */
+	packet = iq->iq_packet[iq->iq_count];
+	addr = &iq->iq_addr[iq->iq_count];
+	memcpy(addr, fsa, fsalen);
+	if (iq->iq_family == AF_INET) {
+		len = icmp_build(packet, (struct sockaddr_in *)lsa,
+		    (struct sockaddr_in *)fsa);
+		((struct sockaddr_in *)addr)->sin_port = 0;
+	} else {
+		len = icmp6_build(packet, (struct sockaddr_in6 *)lsa,
+		    (struct sockaddr_in6 *)fsa);
+		((struct sockaddr_in6 *)addr)->sin6_port = 0;
+	}
+	iq->iq_iov[iq->iq_count].iov_base = packet;
+	iq->iq_iov[iq->iq_count].iov_len = len;
+	msg = &iq->iq_mmsg[iq->iq_count].msg_hdr;
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_name = addr;
+	msg->msg_namelen = fsalen;
+	msg->msg_iov = &iq->iq_iov[iq->iq_count];
+	msg->msg_iovlen = 1;
+
+	if (iq->iq_count++ == 0) {
+		struct timeval	 to;
+
+		timerclear(&to);
+		evtimer_add(&iq->iq_flush, &to);
+	}
+}
+
+void
+icmp_flush(int fd, short event, void *arg)
+{
+	struct icmp_queue	*iq = arg;
+	struct mmsghdr		*mmsg = iq->iq_mmsg;
+	unsigned int		 num = iq->iq_count;
+	int			 n, s;
+
+	s = iq->iq_family == AF_INET ? sicmp : sicmp6;
+	while (num > 0) {
+		if ((n = sendmmsg(s, mmsg, num, 0)) == -1)
+			err(1, "sendmmsg icmp");
+		stat_add(iq->iq_family == AF_INET ?
+		    stat_sndicmp : stat_sndicmp6, n);
+		mmsg += n;
+		num -= n;
+	}
+	iq->iq_count = 0;
 }
 
 void
@@ -181,9 +727,9 @@ icmp_callback(int s, short event, void *arg)
 	char     rbuf[1500];
 
 	if (event & EV_READ) {
-		if (recv(sicmp, rbuf, sizeof(rbuf), 0) == -1)
+		if (recv(s, rbuf, sizeof(rbuf), 0) == -1)
 			err(1, "recv icmp");
-		stat_rcvicmp++;
+		stat_inc(s == sicmp ? stat_rcvicmp : stat_rcvicmp6);
 	}
 }
 
@@ -191,78 +737,1950 @@ void
 icmp_destroy(void)
 {
 	event_del(&evicmp);
+	if (sicmp6 != -1)
+		event_del(&evicmp6);
+}
+
+size_t
+socket_payload(size_t hdrlen)
+{
+	size_t		 wlen;
+
+	if (payload_bound == 0)
+		return (hdrlen);
+	/* The header is always sent, the packet may be longer. */
+	wlen = random_uniform(payload_bound + 1);
+	return (wlen < hdrlen ? hdrlen : wlen);
 }
 
 void
-socket_send(int s, const char *wbuf, struct sockaddr *fsa, size_t fsalen)
+socket_msghdr(struct msghdr *msg, struct iovec *iov, const void *hdr,
+    size_t hdrlen, struct sockaddr *fsa, size_t fsalen)
 {
 	size_t		 wlen;
+
+	/*
+	 * The packet consists of the header and a zero filled payload
+	 * of random length.
+	 */
+	wlen = socket_payload(hdrlen);
+	iov[0].iov_base = (void *)(uintptr_t)hdr;
+	iov[0].iov_len = hdrlen;
+	iov[1].iov_base = payload;
+	iov[1].iov_len = wlen - hdrlen;
+	msg->msg_name = fsa;
+	msg->msg_namelen = fsalen;
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 2;
+	msg->msg_control = NULL;
+	msg->msg_controllen = 0;
+	msg->msg_flags = 0;
+}
+
+void
+socket_rcviov(struct iovec *iov, void *hdr, size_t hdrlen)
+{
+	static __thread char	*buf;
+
+	/*
+	 * Read the payload behind the header into a buffer that all
+	 * sockets of the worker share.  Only the received length is
+	 * interesting, it is needed to count the bytes.
+	 */
+	if (buf == NULL && (buf = malloc(RECV_BUFSIZE)) == NULL)
+		err(1, "malloc");
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hdrlen;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = RECV_BUFSIZE;
+}
+
+void
+socket_send(int s, const void *hdr, size_t hdrlen, struct sockaddr *fsa,
+    size_t fsalen)
+{
+	struct msghdr	 msg;
+	struct iovec	 iov[2];
 	ssize_t		 n;
+	PROFILE_SCOPE(prof_send);
 
-	if (payload_bound) {
-		static char       *payload = NULL;
+	socket_msghdr(&msg, iov, hdr, hdrlen, fsalen ? fsa : NULL, fsalen);
+	if ((n = sendmsg(s, &msg, 0)) == -1)
+		stat_inc(stat_snderr);
+	else {
+		stat_inc(stat_send);
+		stat_add(stat_sndbytes, n);
+	}
+}
 
-		if (payload == NULL)
-			if ((payload = calloc(payload_bound, 1)) == NULL)
-				err(1, "calloc");
-		wbuf = payload;
-		wlen = arc4random_uniform(payload_bound + 1);
-	} else
-		wlen = strlen(wbuf);
+void
+socket_train(int s, const struct payload_header *ph, unsigned int num,
+    struct sockaddr *fsa, size_t fsalen)
+{
+	struct iovec	 iov[TRAIN_MAX][2];
+	struct mmsghdr	 mmsg[TRAIN_MAX];
+	size_t		 wlen;
+	unsigned int	 i;
 
-	if (fsalen)
-		n = sendto(s, wbuf, wlen, 0, fsa, fsalen);
-	else
-		n = send(s, wbuf, wlen, 0);
-	if (n == -1)
-		stat_snderr++;
-	else
-		stat_send++;
+	if (num > TRAIN_MAX)
+		errx(1, "socket_train: train length %u too big", num);
+
+	/* All datagrams of a train have the same random length. */
+	wlen = socket_payload(sizeof(*ph));
+	for (i = 0; i < num; i++) {
+		iov[i][0].iov_base = (void *)(uintptr_t)&ph[i];
+		iov[i][0].iov_len = sizeof(*ph);
+		iov[i][1].iov_base = payload;
+		iov[i][1].iov_len = wlen - sizeof(*ph);
+	}
+
+#ifdef UDP_SEGMENT
+	if (num > 1 && 2 * wlen <= TRAIN_MAXBYTES) {
+		union {
+			struct cmsghdr	 hdr;
+			unsigned char	 buf[CMSG_SPACE(sizeof(uint16_t))];
+		} cmsgbuf;
+		struct msghdr	 msg;
+		struct cmsghdr	*cmsg;
+		unsigned int	 n;
+		ssize_t		 len;
+
+		/*
+		 * The iovec array is one stream of bytes, the kernel
+		 * cuts it into datagrams of the segment size.  Long
+		 * trains need more than one send.
+		 */
+		memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+		msg.msg_name = fsalen ? fsa : NULL;
+		msg.msg_namelen = fsalen;
+		msg.msg_control = &cmsgbuf.buf;
+		msg.msg_controllen = sizeof(cmsgbuf.buf);
+		msg.msg_flags = 0;
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = IPPROTO_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		*(uint16_t *)CMSG_DATA(cmsg) = wlen;
+		for (i = 0; i < num; i += n) {
+			n = TRAIN_MAXBYTES / wlen;
+			if (n > num - i)
+				n = num - i;
+			msg.msg_iov = iov[i];
+			msg.msg_iovlen = 2 * n;
+			if ((len = sendmsg(s, &msg, 0)) == -1) {
+				stat_add(stat_snderr, n);
+				continue;
+			}
+			stat_add(stat_send, n);
+			stat_add(stat_sndbytes, len);
+			stat_add(stat_sndsave, n - 1);
+			stat_inc(stat_sndgso);
+		}
+		return;
+	}
+#endif
+	/* Without segmentation offload send one datagram per message. */
+	for (i = 0; i < num; i++) {
+		mmsg[i].msg_hdr.msg_name = fsalen ? fsa : NULL;
+		mmsg[i].msg_hdr.msg_namelen = fsalen;
+		mmsg[i].msg_hdr.msg_iov = iov[i];
+		mmsg[i].msg_hdr.msg_iovlen = 2;
+		mmsg[i].msg_hdr.msg_control = NULL;
+		mmsg[i].msg_hdr.msg_controllen = 0;
+		mmsg[i].msg_hdr.msg_flags = 0;
+	}
+	socket_sendmmsg(s, mmsg, num);
 }
 
+/*
+ * Zero copy send path.  The kernel pins the pages of the buffer
+ * until the datagram has left the host.  It reports ranges of
+ * completed sends on the error queue of the socket.  A buffer must
+ * not be changed before it has been released.  Every worker has its
+ * own buffers and a queue of busy buffers per file descriptor.
+ */
+__thread struct zc_list		 zc_free;
+__thread struct zc_list		*zc_busy;
+__thread uint32_t		*zc_next;
+__thread uint64_t		*zc_closed;
+__thread int			*zc_linger;
+__thread unsigned int		 zc_nlinger;
+__thread int			 zc_nfd;
+__thread struct event		 zc_event;
+
 void
-statistic_init(void)
+zerocopy_init(void)
 {
-	signal_set(&evstat, SIGINFO, statistic_callback, &evstat);
-	if (statistics)
-		statistic_callback(SIGINFO, EV_TIMEOUT, &evstat);
-	else
-		signal_add(&evstat, NULL);
+	struct zc_buffer	*zb;
+	unsigned int		 i;
+	int			 fd;
+
+	TAILQ_INIT(&zc_free);
+	for (i = 0; i < ZEROCOPY_BUFFERS; i++) {
+		if ((zb = malloc(sizeof(*zb))) == NULL)
+			err(1, "malloc");
+		/* The payload is zero, only the header is written. */
+		if ((zb->zb_data = calloc(1, payload_bound)) == NULL)
+			err(1, "calloc");
+		TAILQ_INSERT_TAIL(&zc_free, zb, zb_entry);
+	}
+	zc_nfd = getdtablesize();
+	if ((zc_busy = calloc(zc_nfd, sizeof(*zc_busy))) == NULL)
+		err(1, "calloc");
+	if ((zc_next = calloc(zc_nfd, sizeof(*zc_next))) == NULL)
+		err(1, "calloc");
+	if ((zc_closed = calloc(zc_nfd, sizeof(*zc_closed))) == NULL)
+		err(1, "calloc");
+	if ((zc_linger = calloc(zc_nfd, sizeof(*zc_linger))) == NULL)
+		err(1, "calloc");
+	for (fd = 0; fd < zc_nfd; fd++)
+		TAILQ_INIT(&zc_busy[fd]);
+	evtimer_set(&zc_event, zerocopy_linger, &zc_event);
+	event_base_set(worker->w_base, &zc_event);
 }
 
 void
-statistic_callback(int sig, short event, void *arg)
+zerocopy_socket(int s)
 {
-	struct event	*evs = arg;
-	const char	*fmt;
-	static int	 line;
+#ifdef SO_ZEROCOPY
+	int	 optval = 1;
 
-	if (line-- == 0 || (event & EV_SIGNAL)) {
-		fmt = icmp_percentage ? " %7s %7s %7s %7s %7s %7s %7s %7s\n" :
-		    " %7s %7s %7s %7s %7s %7s\n";
-		printf(fmt, "open", "send", "snderr", "recv", "rcverr",
-		    "error", "sndicmp", "rcvicmp");
-		line = 19;
+	if (s >= zc_nfd)
+		errx(1, "zerocopy_socket: descriptor %d too big", s);
+	if (setsockopt(s, SOL_SOCKET, SO_ZEROCOPY, &optval,
+	    sizeof(optval)) == -1)
+		err(1, "setsockopt zerocopy");
+	zc_next[s] = 0;
+#endif
+}
+
+void
+zerocopy_send(int s, const void *hdr, size_t hdrlen, struct sockaddr *fsa,
+    size_t fsalen)
+{
+#ifdef SO_ZEROCOPY
+	struct zc_buffer	*zb;
+	struct msghdr		 msg;
+	struct iovec		 iov;
+	size_t			 wlen;
+	ssize_t			 n;
+
+	wlen = socket_payload(hdrlen);
+	if (wlen < ZEROCOPY_MINLEN) {
+		socket_send(s, hdr, hdrlen, fsa, fsalen);
+		return;
 	}
-	fmt = icmp_percentage ? " %7d %7d %7d %7d %7d %7d %7d %7d\n" :
-	    " %7d %7d %7d %7d %7d %7d\n";
-	printf(fmt, stat_open, stat_send, stat_snderr, stat_recv, stat_rcverr,
-	    stat_error, stat_sndicmp, stat_rcvicmp);
-	if (event & EV_TIMEOUT) {
+	if ((zb = TAILQ_FIRST(&zc_free)) == NULL) {
+		/* All buffers are in flight, copy into the kernel. */
+		stat_inc(stat_zcbusy);
+		socket_send(s, hdr, hdrlen, fsa, fsalen);
+		return;
+	}
+	memcpy(zb->zb_data, hdr, hdrlen);
+	iov.iov_base = zb->zb_data;
+	iov.iov_len = wlen;
+	msg.msg_name = fsalen ? fsa : NULL;
+	msg.msg_namelen = fsalen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = NULL;
+	msg.msg_controllen = 0;
+	msg.msg_flags = 0;
+	if ((n = sendmsg(s, &msg, MSG_ZEROCOPY)) == -1) {
+		stat_inc(stat_snderr);
+		return;
+	}
+	stat_inc(stat_send);
+	stat_add(stat_sndbytes, n);
+	stat_inc(stat_zcsend);
+
+	/* The kernel counts successful zero copy sends per socket. */
+	zb->zb_seq = zc_next[s]++;
+	TAILQ_REMOVE(&zc_free, zb, zb_entry);
+	TAILQ_INSERT_TAIL(&zc_busy[s], zb, zb_entry);
+#else
+	socket_send(s, hdr, hdrlen, fsa, fsalen);
+#endif
+}
+
+void
+zerocopy_reap(int s)
+{
+#ifdef SO_ZEROCOPY
+	struct sock_extended_err	*serr;
+	struct zc_buffer		*zb;
+	struct cmsghdr			*cmsg;
+	struct msghdr			 msg;
+	uint32_t			 n;
+	union {
+		struct cmsghdr	 hdr;
+		unsigned char	 buf[CMSG_SPACE(sizeof(*serr)) +
+				    CMSG_SPACE(sizeof(struct sockaddr_in6))];
+	} cmsgbuf;
+
+	/*
+	 * Each notification contains the range of completed sends.
+	 * Sends complete in order, release the busy buffers up to the
+	 * end of the range.
+	 */
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = &cmsgbuf.buf;
+		msg.msg_controllen = sizeof(cmsgbuf);
+		if (recvmsg(s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			if (errno == EAGAIN)
+				return;
+			err(1, "recvmsg errqueue");
+		}
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == IPPROTO_IP &&
+			    cmsg->cmsg_type == IP_RECVERR) &&
+			    !(cmsg->cmsg_level == IPPROTO_IPV6 &&
+			    cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			n = serr->ee_data - serr->ee_info + 1;
+			stat_add(stat_zcdone, n);
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				stat_add(stat_zccopied, n);
+			while ((zb = TAILQ_FIRST(&zc_busy[s])) != NULL &&
+			    (int32_t)(zb->zb_seq - serr->ee_data) <= 0) {
+				TAILQ_REMOVE(&zc_busy[s], zb, zb_entry);
+				TAILQ_INSERT_TAIL(&zc_free, zb, zb_entry);
+			}
+		}
+	}
+#endif
+}
+
+void
+zerocopy_close(int s)
+{
+	struct timeval	 to;
+
+	/*
+	 * Notifications get lost when the socket is closed, but the
+	 * kernel may still send from the busy buffers.  Keep the
+	 * socket open and reap it from a timer until all its buffers
+	 * have been released.
+	 */
+	zerocopy_reap(s);
+	if (TAILQ_EMPTY(&zc_busy[s])) {
+		if (close(s) == -1)
+			err(1, "close");
+		return;
+	}
+	if (zc_nlinger == 0) {
+		to.tv_sec = 0;
+		to.tv_usec = ZEROCOPY_REAP;
+		evtimer_add(&zc_event, &to);
+	}
+	zc_closed[s] = monotonic_nsec();
+	zc_linger[zc_nlinger++] = s;
+}
+
+void
+zerocopy_linger(int fd, short event, void *arg)
+{
+	struct zc_buffer	*zb;
+	struct timeval		 to;
+	uint64_t		 now;
+	unsigned int		 i;
+	int			 s;
+
+	now = monotonic_nsec();
+	for (i = 0; i < zc_nlinger; ) {
+		s = zc_linger[i];
+		zerocopy_reap(s);
+		if (!TAILQ_EMPTY(&zc_busy[s])) {
+			if (now - zc_closed[s] < ZEROCOPY_LINGER) {
+				i++;
+				continue;
+			}
+			/*
+			 * The release was never reported.  The kernel
+			 * may still own the data, replace it.
+			 */
+			while ((zb = TAILQ_FIRST(&zc_busy[s])) != NULL) {
+				TAILQ_REMOVE(&zc_busy[s], zb, zb_entry);
+				if ((zb->zb_data = calloc(1, payload_bound)) ==
+				    NULL)
+					err(1, "calloc");
+				TAILQ_INSERT_TAIL(&zc_free, zb, zb_entry);
+			}
+		}
+		if (close(s) == -1)
+			err(1, "close");
+		zc_linger[i] = zc_linger[--zc_nlinger];
+	}
+	if (zc_nlinger > 0) {
+		to.tv_sec = 0;
+		to.tv_usec = ZEROCOPY_REAP;
+		evtimer_add(&zc_event, &to);
+	}
+}
+
+/*
+ * Responses that are due in the same event loop iteration are
+ * collected in a per worker transmit queue.  A zero timeout flushes
+ * them with one sendmmsg system call per socket after all active
+ * events have been processed.
+ */
+__thread struct mmsghdr		*sq_mmsg;
+__thread struct iovec		(*sq_iov)[2];
+__thread struct payload_header	*sq_hdr;
+__thread struct sockaddr_storage	*sq_addr;
+__thread int			*sq_sock;
+__thread unsigned int		 sq_count;
+
+void
+socket_enqueue(int s, const void *hdr, size_t hdrlen, struct sockaddr *fsa,
+    size_t fsalen)
+{
+	if (sq_mmsg == NULL) {
+		if ((sq_mmsg = calloc(mmsg_number, sizeof(*sq_mmsg))) == NULL)
+			err(1, "calloc");
+		if ((sq_iov = calloc(mmsg_number, sizeof(*sq_iov))) == NULL)
+			err(1, "calloc");
+		if ((sq_hdr = calloc(mmsg_number, sizeof(*sq_hdr))) == NULL)
+			err(1, "calloc");
+		if ((sq_addr = calloc(mmsg_number, sizeof(*sq_addr))) == NULL)
+			err(1, "calloc");
+		if ((sq_sock = calloc(mmsg_number, sizeof(*sq_sock))) == NULL)
+			err(1, "calloc");
+		evtimer_set(&evflush, socket_flush, &evflush);
+		event_base_set(worker->w_base, &evflush);
+	}
+	if (sq_count == mmsg_number)
+		socket_flush(-1, EV_TIMEOUT, &evflush);
+	if (hdrlen > sizeof(*sq_hdr))
+		errx(1, "socket_enqueue: hdrlen %zu too big", hdrlen);
+	if (fsalen > sizeof(*sq_addr))
+		errx(1, "socket_enqueue: addrlen %zu too big", fsalen);
+
+	memcpy(&sq_hdr[sq_count], hdr, hdrlen);
+	memcpy(&sq_addr[sq_count], fsa, fsalen);
+	socket_msghdr(&sq_mmsg[sq_count].msg_hdr, sq_iov[sq_count],
+	    &sq_hdr[sq_count], hdrlen, (struct sockaddr *)&sq_addr[sq_count],
+	    fsalen);
+	sq_sock[sq_count] = s;
+
+	if (sq_count++ == 0) {
 		struct timeval	 to;
 
-		to.tv_sec = 1;
-		to.tv_usec = 0;
-		signal_add(evs, &to);
-		stat_send = stat_snderr = stat_recv = stat_rcverr =
-		    stat_error = stat_sndicmp = stat_rcvicmp = 0;
+		timerclear(&to);
+		evtimer_add(&evflush, &to);
+	}
+}
+
+void
+socket_sendmmsg(int s, struct mmsghdr *mmsg, unsigned int num)
+{
+	int		 i, n;
+
+	/*
+	 * If sendmmsg fails after some packets have been sent, it
+	 * returns the number of sent packets.  The error is reported
+	 * by the next call that starts with the failing packet.
+	 */
+	while (num > 0) {
+		if ((n = sendmmsg(s, mmsg, num, 0)) == -1) {
+			stat_inc(stat_snderr);
+			n = 1;
+		} else {
+			stat_add(stat_send, n);
+			stat_add(stat_sndsave, n - 1);
+			for (i = 0; i < n; i++)
+				stat_add(stat_sndbytes, mmsg[i].msg_len);
+		}
+		mmsg += n;
+		num -= n;
+	}
+}
+
+void
+socket_flush(int fd, short event, void *arg)
+{
+	unsigned int	 i, j;
+
+	for (i = 0; i < sq_count; i = j) {
+		for (j = i + 1; j < sq_count && sq_sock[j] == sq_sock[i]; j++)
+			continue;
+		socket_sendmmsg(sq_sock[i], &sq_mmsg[i], j - i);
+	}
+	sq_count = 0;
+}
+
+void
+worker_init(void)
+{
+	struct worker	*w;
+	unsigned int	 n;
+	int		 error;
+
+	if ((error = posix_memalign((void **)&workers, CACHELINE_SIZE,
+	    worker_number * sizeof(*workers))) != 0)
+		errc(1, error, "posix_memalign");
+	memset(workers, 0, worker_number * sizeof(*workers));
+	/* Keep the seed in the range of -S, it can be used again. */
+	if (!random_seeded)
+		random_seed = ((uint64_t)arc4random() << 32 | arc4random()) &
+		    LLONG_MAX;
+	for (n = 0, w = workers; n < worker_number; n++, w++) {
+		w->w_id = n;
+		random_init(w);
+		if (n == 0)
+			w->w_base = eb;
+		else if ((w->w_base = event_base_new()) == NULL)
+			err(1, "event_base_new");
+		/* Distribute the sockets evenly over all workers. */
+		w->w_sockets = socket_number / worker_number +
+		    (n < socket_number % worker_number);
+	}
+	worker = workers;
+	worker_running = worker_number;
+
+	if (worker_number > 1) {
+		if (pipe(worker_pipe) == -1)
+			err(1, "pipe");
+		event_set(&evdone, worker_pipe[0], EV_READ, worker_callback,
+		    &evdone);
+		event_add(&evdone, NULL);
 	}
 }
 
+void
+worker_start(void)
+{
+	struct worker	*w;
+	sigset_t	 set, oset;
+	unsigned int	 n;
+	int		 error;
+
+	/* Signals are handled by the event loop of the main thread. */
+	sigfillset(&set);
+	if ((error = pthread_sigmask(SIG_BLOCK, &set, &oset)) != 0)
+		errc(1, error, "pthread_sigmask");
+	for (n = 1, w = workers + 1; n < worker_number; n++, w++) {
+		if ((error = pthread_create(&w->w_thread, NULL,
+		    worker_thread, w)) != 0)
+			errc(1, error, "pthread_create");
+	}
+	if ((error = pthread_sigmask(SIG_SETMASK, &oset, NULL)) != 0)
+		errc(1, error, "pthread_sigmask");
+}
+
+void *
+worker_thread(void *arg)
+{
+	worker = arg;
+	if (timer_tick)
+		timer_init();
+	socket_worker();
+	event_base_dispatch(worker->w_base);
+	return (NULL);
+}
+
+void
+worker_done(void)
+{
+	/* Send the queued responses before the statistics are final. */
+	if (sq_count > 0) {
+		event_del(&evflush);
+		socket_flush(-1, EV_TIMEOUT, &evflush);
+	}
+	if (timer_tick)
+		timer_destroy();
+
+	/*
+	 * The last worker that has finished all its sockets stops the
+	 * events of the main thread, so that its event loop returns.
+	 */
+	if (__sync_sub_and_fetch(&worker_running, 1) > 0)
+		return;
+	if (worker == workers)
+		worker_callback(-1, EV_READ, &evdone);
+	else if (write(worker_pipe[1], "", 1) == -1)
+		err(1, "write worker pipe");
+}
+
+void
+worker_callback(int fd, short event, void *arg)
+{
+	if (icmp_percentage)
+		icmp_destroy();
+	if (lag_threshold)
+		event_del(&evlag);
+	statistic_destroy();
+	if (shm_file)
+		shm_destroy();
+#ifdef PROFILE
+	prof_destroy();
+#endif
+	if (worker_number > 1)
+		event_del(&evdone);
+}
+
+void
+worker_destroy(void)
+{
+	struct worker	*w;
+	unsigned int	 n;
+	int		 error;
+
+	for (n = 1, w = workers + 1; n < worker_number; n++, w++) {
+		if ((error = pthread_join(w->w_thread, NULL)) != 0)
+			errc(1, error, "pthread_join");
+	}
+}
+
+uint64_t
+monotonic_nsec(void)
+{
+	struct timespec	 ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * Hierarchical timer wheel.  Each level has 64 slots, a slot of the
+ * first level covers one tick, a slot of the next level covers all
+ * slots of the previous one.  Timers are moved to a lower level when
+ * the wheel of the lower level has turned around.  Arming and
+ * cancelling a timer is O(1).  A single periodic libevent timeout
+ * per worker advances the wheel.
+ */
+#define TIMER_BITS	6
+#define TIMER_SIZE	(1 << TIMER_BITS)
+#define TIMER_MASK	(TIMER_SIZE - 1)
+#define TIMER_LEVELS	4
+
+struct timer_wheel {
+	struct timer_list	 tw_list[TIMER_LEVELS][TIMER_SIZE];
+	struct event		 tw_event;
+	uint64_t		 tw_start;	/* nanoseconds of tick 0 */
+	uint64_t		 tw_tick;	/* next tick to process */
+	int			 tw_stopped;
+};
+
+__thread struct timer_wheel	*wheel;
+
+void
+timer_init(void)
+{
+	struct timeval	 to;
+	unsigned int	 level, slot;
+
+	if ((wheel = calloc(1, sizeof(*wheel))) == NULL)
+		err(1, "calloc");
+	for (level = 0; level < TIMER_LEVELS; level++)
+		for (slot = 0; slot < TIMER_SIZE; slot++)
+			TAILQ_INIT(&wheel->tw_list[level][slot]);
+	wheel->tw_start = monotonic_nsec();
+	wheel->tw_tick = 0;
+
+	evtimer_set(&wheel->tw_event, timer_callback, &wheel->tw_event);
+	event_base_set(worker->w_base, &wheel->tw_event);
+	to.tv_sec = timer_tick / 1000000;
+	to.tv_usec = timer_tick % 1000000;
+	evtimer_add(&wheel->tw_event, &to);
+}
+
+void
+timer_destroy(void)
+{
+	/* Stop the tick, the event loop of a finished worker returns. */
+	evtimer_del(&wheel->tw_event);
+	wheel->tw_stopped = 1;
+}
+
+void
+timer_set(struct timer *tm, int fd, void (*func)(int, short, void *),
+    void *arg)
+{
+	tm->tm_list = NULL;
+	tm->tm_func = func;
+	tm->tm_arg = arg;
+	tm->tm_fd = fd;
+}
+
+void
+timer_add(struct timer *tm, const struct timeval *tv)
+{
+	uint64_t	 tick = timer_tick * 1000ULL;
+
+	timer_del(tm);
+	tm->tm_deadline = monotonic_nsec() +
+	    tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+	/* Round up, a timer must never fire before its deadline. */
+	tm->tm_expire = (tm->tm_deadline - wheel->tw_start + tick - 1) / tick;
+	timer_insert(tm);
+}
+
+void
+timer_del(struct timer *tm)
+{
+	if (tm->tm_list == NULL)
+		return;
+	TAILQ_REMOVE(tm->tm_list, tm, tm_entry);
+	tm->tm_list = NULL;
+}
+
+void
+timer_insert(struct timer *tm)
+{
+	uint64_t	 expire = tm->tm_expire;
+	int64_t		 delta = expire - wheel->tw_tick;
+	unsigned int	 level;
+
+	if (delta < 0) {
+		/* Already expired, run it with the next tick. */
+		expire = wheel->tw_tick;
+		delta = 0;
+	}
+	for (level = 0; level < TIMER_LEVELS - 1; level++) {
+		if (delta < 1LL << ((level + 1) * TIMER_BITS))
+			break;
+	}
+	if (delta >= 1LL << (TIMER_LEVELS * TIMER_BITS)) {
+		/* Beyond the wheel, park it in the last slot reachable. */
+		expire = wheel->tw_tick +
+		    (1ULL << (TIMER_LEVELS * TIMER_BITS)) - 1;
+	}
+	tm->tm_list = &wheel->tw_list[level]
+	    [(expire >> (level * TIMER_BITS)) & TIMER_MASK];
+	TAILQ_INSERT_TAIL(tm->tm_list, tm, tm_entry);
+}
+
+void
+timer_cascade(struct timer_list *list)
+{
+	struct timer_list	 move;
+	struct timer		*tm;
+
+	TAILQ_INIT(&move);
+	TAILQ_CONCAT(&move, list, tm_entry);
+	while ((tm = TAILQ_FIRST(&move)) != NULL) {
+		TAILQ_REMOVE(&move, tm, tm_entry);
+		timer_insert(tm);
+	}
+}
+
+void
+timer_callback(int fd, short event, void *arg)
+{
+	struct timer_list	 fire;
+	struct timer		*tm;
+	struct timeval		 to;
+	uint64_t		 now, target;
+	unsigned int		 level, slot;
+
+	now = monotonic_nsec();
+	target = (now - wheel->tw_start) / (timer_tick * 1000ULL);
+	while (wheel->tw_tick <= target) {
+		slot = wheel->tw_tick & TIMER_MASK;
+		for (level = 1; slot == 0 && level < TIMER_LEVELS; level++) {
+			slot = (wheel->tw_tick >> (level * TIMER_BITS)) &
+			    TIMER_MASK;
+			timer_cascade(&wheel->tw_list[level][slot]);
+		}
+
+		/*
+		 * Take all timers of this tick from the wheel before
+		 * running them.  A callback may add new timers or delete
+		 * timers that are about to fire.
+		 */
+		TAILQ_INIT(&fire);
+		TAILQ_CONCAT(&fire, &wheel->tw_list[0]
+		    [wheel->tw_tick & TIMER_MASK], tm_entry);
+		TAILQ_FOREACH(tm, &fire, tm_entry)
+			tm->tm_list = &fire;
+		wheel->tw_tick++;
+		while ((tm = TAILQ_FIRST(&fire)) != NULL) {
+			TAILQ_REMOVE(&fire, tm, tm_entry);
+			tm->tm_list = NULL;
+			stat_inc(stat_tmfire);
+			if (now > tm->tm_deadline)
+				stat_add(stat_tmlate,
+				    (now - tm->tm_deadline) / 1000);
+			tm->tm_func(tm->tm_fd, EV_TIMEOUT, tm->tm_arg);
+		}
+	}
+
+	/* A timer callback may have finished the worker. */
+	if (wheel->tw_stopped)
+		return;
+	to.tv_sec = timer_tick / 1000000;
+	to.tv_usec = timer_tick % 1000000;
+	evtimer_add(&wheel->tw_event, &to);
+}
+
+/*
+ * Log-linear histogram.  Values below 2^HIST_SUBBITS have their own
+ * bucket.  Above, every power of two is split into HIST_SUBCOUNT
+ * buckets, so the relative error is below 1/HIST_SUBCOUNT.
+ */
+unsigned int
+hist_index(uint64_t v)
+{
+	unsigned int	 e;
+
+	if (v < HIST_SUBCOUNT)
+		return (v);
+	e = 63 - __builtin_clzll(v);
+	return ((e - HIST_SUBBITS + 1) * HIST_SUBCOUNT +
+	    ((v >> (e - HIST_SUBBITS)) & (HIST_SUBCOUNT - 1)));
+}
+
+uint64_t
+hist_value(unsigned int i)
+{
+	unsigned int	 e, sub;
+
+	/* Return the highest value that falls into the bucket. */
+	if (i < HIST_SUBCOUNT)
+		return (i);
+	e = i / HIST_SUBCOUNT + HIST_SUBBITS - 1;
+	sub = i % HIST_SUBCOUNT;
+	return (((uint64_t)(HIST_SUBCOUNT + sub + 1) << (e - HIST_SUBBITS))
+	    - 1);
+}
+
+void
+hist_add(struct histogram *h, uint64_t v)
+{
+	h->h_count[hist_index(v)]++;
+}
+
+uint64_t
+hist_total(const struct histogram *h)
+{
+	uint64_t	 total = 0;
+	unsigned int	 i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		total += h->h_count[i];
+	return (total);
+}
+
+uint64_t
+hist_percentile(const struct histogram *h, uint64_t total, double p)
+{
+	uint64_t	 rank, sum = 0;
+	unsigned int	 i;
+
+	if (total == 0)
+		return (0);
+	rank = total * p / 100;
+	if (rank < total * p / 100 || rank == 0)
+		rank++;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += h->h_count[i];
+		if (sum >= rank)
+			return (hist_value(i));
+	}
+	return (hist_value(HIST_BUCKETS - 1));
+}
+
+/*
+ * Sum a histogram over all workers, off is its offset in the worker
+ * structure.  Workers write their histograms unlocked, a slightly
+ * stale count is good enough.
+ */
+void
+hist_sum(struct histogram *sum, size_t off)
+{
+	const struct histogram	*h;
+	struct worker		*w;
+	unsigned int		 c, n;
+
+	memset(sum, 0, sizeof(*sum));
+	for (n = 0, w = workers; n < worker_number; n++, w++) {
+		h = (const struct histogram *)((const char *)w + off);
+		for (c = 0; c < HIST_BUCKETS; c++)
+			sum->h_count[c] += h->h_count[c];
+	}
+}
+
+/* The histogram of an interval is the difference of two sums. */
+void
+hist_delta(struct histogram *delta, const struct histogram *sum,
+    const struct histogram *last)
+{
+	unsigned int	 c;
+
+	for (c = 0; c < HIST_BUCKETS; c++)
+		delta->h_count[c] = sum->h_count[c] - last->h_count[c];
+}
+
+/*
+ * Every worker has its own xoshiro256** pseudo random number
+ * generator.  It is seeded from the global seed and the worker number,
+ * so the sequence of random decisions of each worker can be repeated.
+ */
+void
+random_init(struct worker *w)
+{
+	uint64_t	 x;
+	unsigned int	 i;
+
+	/* Expand the seed with splitmix64 to get a nonzero state. */
+	x = random_seed + w->w_id;
+	for (i = 0; i < 4; i++) {
+		uint64_t	 z;
+
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		w->w_random[i] = z ^ (z >> 31);
+	}
+}
+
+static inline uint64_t
+rotl(uint64_t x, int k)
+{
+	return ((x << k) | (x >> (64 - k)));
+}
+
+uint64_t
+random_next(void)
+{
+	uint64_t	*r = worker->w_random;
+	uint64_t	 result, t;
+
+	result = rotl(r[1] * 5, 7) * 9;
+	t = r[1] << 17;
+	r[2] ^= r[0];
+	r[3] ^= r[1];
+	r[1] ^= r[2];
+	r[0] ^= r[3];
+	r[2] ^= t;
+	r[3] = rotl(r[3], 45);
+	return (result);
+}
+
+uint32_t
+random_uniform(uint32_t upper_bound)
+{
+	uint64_t	 m;
+	uint32_t	 l, t;
+
+	/*
+	 * Like arc4random_uniform(3), return a uniformly distributed
+	 * number less than upper_bound.  Multiply and shift instead of
+	 * modulo, reject the few values that would cause a bias.
+	 */
+	if (upper_bound < 2)
+		return (0);
+	m = (random_next() >> 32) * upper_bound;
+	l = (uint32_t)m;
+	if (l < upper_bound) {
+		t = -upper_bound % upper_bound;
+		while (l < t) {
+			m = (random_next() >> 32) * upper_bound;
+			l = (uint32_t)m;
+		}
+	}
+	return (m >> 32);
+}
+
+/*
+ * Parse a time with unit us, ms or s into microseconds.  Without
+ * unit it is seconds.
+ */
+uint32_t
+time_parse(const char *arg, const char *what)
+{
+	char		 num[16];
+	const char	*errstr, *unit;
+	uint64_t	 scale, value;
+	size_t		 len;
+
+	len = strspn(arg, "0123456789");
+	if (len == 0 || len >= sizeof(num))
+		errx(1, "%s time is invalid: %s", what, arg);
+	memcpy(num, arg, len);
+	num[len] = '\0';
+	unit = arg + len;
+	if (*unit == '\0' || strcmp(unit, "s") == 0)
+		scale = 1000000;
+	else if (strcmp(unit, "ms") == 0)
+		scale = 1000;
+	else if (strcmp(unit, "us") == 0)
+		scale = 1;
+	else
+		errx(1, "%s time has unknown unit: %s", what, arg);
+	value = strtonum(num, 1, TIME_MAX, &errstr);
+	if (errstr)
+		errx(1, "%s time is %s: %s", what, errstr, arg);
+	if (value * scale > TIME_MAX)
+		errx(1, "%s time is too large: %s", what, arg);
+	return (value * scale);
+}
+
+/*
+ * Select the distribution of random times, e.g. exp:200ms for an
+ * exponential distribution with mean 200 milliseconds.
+ */
+void
+dist_parse(const char *arg)
+{
+	static const struct {
+		const char	*name;
+		enum dist_type	 type;
+	} dists[] = {
+		{ "uniform",	dist_uniform },
+		{ "exp",	dist_exponential },
+		{ "pareto",	dist_pareto },
+		{ "fixed",	dist_fixed },
+		{ "empirical",	dist_empirical },
+	};
+	const char	*param;
+	char		*end;
+	size_t		 len;
+	unsigned int	 i;
+
+	if ((param = strchr(arg, ':')) != NULL)
+		len = param++ - arg;
+	else
+		len = strlen(arg);
+	for (i = 0; i < sizeof(dists) / sizeof(dists[0]); i++) {
+		if (strlen(dists[i].name) == len &&
+		    strncmp(arg, dists[i].name, len) == 0)
+			break;
+	}
+	if (i == sizeof(dists) / sizeof(dists[0]))
+		errx(1, "unknown distribution: %s", arg);
+	dist_type = dists[i].type;
+
+	switch (dist_type) {
+	case dist_exponential:
+		if (param != NULL)
+			dist_mean = time_parse(param, "exponential mean");
+		break;
+	case dist_pareto:
+		if (param != NULL) {
+			errno = 0;
+			dist_shape = strtod(param, &end);
+			if (errno || *end != '\0' || !(dist_shape > 0) ||
+			    dist_shape > 100)
+				errx(1, "pareto shape is invalid: %s", param);
+		}
+		break;
+	case dist_empirical:
+		if (param == NULL)
+			errx(1, "empirical distribution needs file: %s", arg);
+		dist_file = param;
+		break;
+	default:
+		if (param != NULL)
+			errx(1, "distribution has no parameter: %s", arg);
+	}
+}
+
+/*
+ * Tabulate the inverse of the cumulative distribution function.
+ * Linear steps in the probability u would lose the long tail, so
+ * 1 - u is split into octaves 2^-(z+1) to 2^-z, each has DIST_STEPS
+ * linear steps.  Both distributions are truncated at the bound.  The
+ * Pareto distribution starts at a thousandth of the bound.
+ */
+void
+dist_table(struct distribution *d)
+{
+	double		 b = d->d_bound, m, l, a, u, x, f;
+	unsigned int	 z, k;
+
+	if ((d->d_table = calloc(DIST_TABLE, sizeof(*d->d_table))) == NULL)
+		err(1, "calloc");
+	m = dist_mean ? dist_mean : b / 4;
+	l = b / 1000 < 1 ? 1 : b / 1000;
+	a = dist_shape;
+	for (z = 0; z < DIST_OCTAVES; z++) {
+		for (k = 0; k <= DIST_STEPS; k++) {
+			u = 1 - ldexp(1 + (double)k / DIST_STEPS, -(z + 1));
+			if (d->d_type == dist_exponential) {
+				f = 1 - exp(-b / m);
+				x = -m * log(1 - u * f);
+			} else {
+				f = 1 - pow(l / b, a);
+				x = l * pow(1 - u * f, -1 / a);
+			}
+			if (x < 1)
+				x = 1;
+			if (x > b)
+				x = b;
+			d->d_table[z * (DIST_STEPS + 1) + k] = x;
+		}
+	}
+}
+
+/*
+ * Read times with optional weight from a file, one per line.  Build
+ * a Walker alias table with the method of Vose, every slot has a
+ * probability for its own value and an alias for the rest.
+ */
+void
+dist_alias(struct distribution *d)
+{
+	FILE		*fp;
+	char		*line = NULL, *str, *weight, *end;
+	size_t		 linesize = 0;
+	uint32_t	*small, *large, ns = 0, nl = 0, n = 0, i, j;
+	double		*w = NULL, *p, sum = 0;
+
+	if ((fp = fopen(dist_file, "r")) == NULL)
+		err(1, "fopen %s", dist_file);
+	while (getline(&line, &linesize, fp) != -1) {
+		if ((str = strtok(line, " \t\n")) == NULL || *str == '#')
+			continue;
+		if (n == DIST_EMPIRICALMAX)
+			errx(1, "%s: more than %u times", dist_file,
+			    DIST_EMPIRICALMAX);
+		if ((n & (n - 1)) == 0) {
+			if ((w = reallocarray(w, n ? 2 * n : 1, sizeof(*w)))
+			    == NULL)
+				err(1, "reallocarray");
+			if ((d->d_value = reallocarray(d->d_value,
+			    n ? 2 * n : 1, sizeof(*d->d_value))) == NULL)
+				err(1, "reallocarray");
+		}
+		d->d_value[n] = time_parse(str, "empirical");
+		if (d->d_value[n] > d->d_bound)
+			d->d_value[n] = d->d_bound;
+		w[n] = 1;
+		if ((weight = strtok(NULL, " \t\n")) != NULL) {
+			errno = 0;
+			w[n] = strtod(weight, &end);
+			if (errno || *end != '\0' || !(w[n] > 0) ||
+			    w[n] > 1e12)
+				errx(1, "%s: weight is invalid: %s",
+				    dist_file, weight);
+		}
+		sum += w[n++];
+	}
+	if (ferror(fp))
+		err(1, "getline %s", dist_file);
+	free(line);
+	fclose(fp);
+	if (n == 0)
+		errx(1, "%s: no times", dist_file);
+
+	d->d_count = n;
+	if ((d->d_alias = calloc(n, sizeof(*d->d_alias))) == NULL ||
+	    (d->d_prob = calloc(n, sizeof(*d->d_prob))) == NULL ||
+	    (small = calloc(n, sizeof(*small))) == NULL ||
+	    (large = calloc(n, sizeof(*large))) == NULL)
+		err(1, "calloc");
+	p = w;
+	for (i = 0; i < n; i++) {
+		p[i] = w[i] * n / sum;
+		if (p[i] < 1)
+			small[ns++] = i;
+		else
+			large[nl++] = i;
+	}
+	while (ns > 0 && nl > 0) {
+		i = small[--ns];
+		j = large[nl - 1];
+		d->d_prob[i] = p[i] * 4294967296.0;
+		d->d_alias[i] = j;
+		p[j] -= 1 - p[i];
+		if (p[j] < 1) {
+			nl--;
+			small[ns++] = j;
+		}
+	}
+	/* Rounding errors leave probabilities close to one. */
+	while (nl > 0) {
+		i = large[--nl];
+		d->d_prob[i] = 4294967296ULL;
+		d->d_alias[i] = i;
+	}
+	while (ns > 0) {
+		i = small[--ns];
+		d->d_prob[i] = 4294967296ULL;
+		d->d_alias[i] = i;
+	}
+	free(small);
+	free(large);
+	free(w);
+}
+
+void
+dist_init(struct distribution *d, uint32_t bound)
+{
+	memset(d, 0, sizeof(*d));
+	d->d_type = dist_type;
+	d->d_bound = bound;
+	switch (d->d_type) {
+	case dist_exponential:
+	case dist_pareto:
+		dist_table(d);
+		break;
+	case dist_empirical:
+		dist_alias(d);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Draw a random time between 1 microsecond and the bound.  Every
+ * distribution needs a constant number of random numbers.
+ */
+uint32_t
+dist_sample(const struct distribution *d)
+{
+	const uint32_t	*row;
+	uint64_t	 r, frac;
+	uint32_t	 i, z;
+
+	switch (d->d_type) {
+	case dist_uniform:
+		return (1 + random_uniform(d->d_bound));
+	case dist_fixed:
+		return (d->d_bound);
+	case dist_exponential:
+	case dist_pareto:
+		/*
+		 * The leading zeros of the random number select the
+		 * octave, the following bits the step.  Interpolate
+		 * linearly within the step.
+		 */
+		r = random_next();
+		z = r ? __builtin_clzll(r) : 63;
+		if (z >= DIST_OCTAVES)
+			z = DIST_OCTAVES - 1;
+		r = r << z << 1;
+		row = d->d_table + z * (DIST_STEPS + 1);
+		i = r >> (64 - DIST_STEPBITS);
+		frac = r >> (32 - DIST_STEPBITS) & 0xffffffff;
+		return (row[i] -
+		    (((uint64_t)(row[i] - row[i + 1]) * frac) >> 32));
+	case dist_empirical:
+		i = random_uniform(d->d_count);
+		if ((random_next() >> 32) < d->d_prob[i])
+			return (d->d_value[i]);
+		return (d->d_value[d->d_alias[i]]);
+	}
+	return (d->d_bound);
+}
+
+void
+dist_timeval(const struct distribution *d, struct timeval *tv)
+{
+	uint32_t	 usec;
+
+	usec = dist_sample(d);
+	tv->tv_sec = usec / 1000000;
+	tv->tv_usec = usec % 1000000;
+}
+
+void
+pool_init(struct pool *pl, size_t size, unsigned int count)
+{
+	unsigned int	 n;
+	int		 error;
+
+	pl->pl_size = (size + CACHELINE_SIZE - 1) & ~(CACHELINE_SIZE - 1);
+	pl->pl_count = count;
+	pl->pl_inuse = 0;
+	if ((error = posix_memalign((void **)&pl->pl_base, CACHELINE_SIZE,
+	    pl->pl_size * count)) != 0)
+		errc(1, error, "posix_memalign");
+	pl->pl_free = NULL;
+	for (n = count; n > 0; n--) {
+		void	**item;
+
+		item = (void **)(pl->pl_base + (n - 1) * pl->pl_size);
+		*item = pl->pl_free;
+		pl->pl_free = item;
+	}
+}
+
+void *
+pool_get(struct pool *pl)
+{
+	void	**item;
+
+	/*
+	 * The pool is sized for the expected number of items.  If it
+	 * is exhausted, count it and fall back to malloc.
+	 */
+	if ((item = pl->pl_free) == NULL) {
+		stat_inc(stat_poolfail);
+		if ((item = malloc(pl->pl_size)) == NULL)
+			err(1, "malloc");
+		return (item);
+	}
+	pl->pl_free = *item;
+	if (++pl->pl_inuse > stat_get(stat_poolmax))
+		stat_inc(stat_poolmax);
+	return (item);
+}
+
+void
+pool_put(struct pool *pl, void *v)
+{
+	void	**item = v;
+
+	if ((char *)v < pl->pl_base ||
+	    (char *)v >= pl->pl_base + pl->pl_size * pl->pl_count) {
+		free(v);
+		return;
+	}
+	*item = pl->pl_free;
+	pl->pl_free = item;
+	pl->pl_inuse--;
+}
+
+/* Names of the counters in machine readable output. */
+const char *stat_names[stat_ncounters] = {
+	[stat_open] =		"open",
+	[stat_send] =		"send",
+	[stat_snderr] =		"snderr",
+	[stat_recv] =		"recv",
+	[stat_rcverr] =		"rcverr",
+	[stat_error] =		"error",
+	[stat_sndicmp] =	"sndicmp",
+	[stat_rcvicmp] =	"rcvicmp",
+	[stat_sndicmp6] =	"sndicmp6",
+	[stat_rcvicmp6] =	"rcvicmp6",
+	[stat_rcvmmsg] =	"rcvmmsg",
+	[stat_rcvbatch] =	"rcvbatch",
+	[stat_sndsave] =	"sndsave",
+	[stat_poolmax] =	"poolmax",
+	[stat_poolfail] =	"poolfail",
+	[stat_tmfire] =		"tmfire",
+	[stat_tmlate] =		"tmlate",
+	[stat_lost] =		"lost",
+	[stat_dup] =		"dup",
+	[stat_reorder] =	"reorder",
+	[stat_corrupt] =	"corrupt",
+	[stat_wrongflow] =	"wrongflow",
+	[stat_shortfall] =	"shortfall",
+	[stat_sndlate] =	"sndlate",
+	[stat_sndbytes] =	"sndbytes",
+	[stat_rcvbytes] =	"rcvbytes",
+	[stat_cached] =		"cached",
+	[stat_cachehit] =	"cachehit",
+	[stat_cachemiss] =	"cachemiss",
+	[stat_cacheevict] =	"cacheevict",
+	[stat_cacheexpire] =	"cacheexpire",
+	[stat_recycle] =	"recycle",
+	[stat_churn] =		"churn",
+	[stat_sndgso] =		"sndgso",
+	[stat_zcsend] =		"zcsend",
+	[stat_zcdone] =		"zcdone",
+	[stat_zccopied] =	"zccopied",
+	[stat_zcbusy] =		"zcbusy",
+};
+
+/* Round trip time percentiles that are reported. */
+const double	 stat_pct[] = { 50, 90, 99, 99.9, 100 };
+const char	*stat_pctnames[] = { "p50", "p90", "p99", "p999", "max" };
+#define STAT_NPCT	(sizeof(stat_pct) / sizeof(stat_pct[0]))
+
+enum stat_format
+statistic_format(const char *name)
+{
+	if (strcmp(name, "text") == 0)
+		return (format_text);
+	if (strcmp(name, "json") == 0)
+		return (format_json);
+	if (strcmp(name, "csv") == 0)
+		return (format_csv);
+	errx(1, "unknown statistics format: %s", name);
+}
+
+/*
+ * Measure how late every timeout fires.  The deadline is taken when
+ * the timeout is scheduled, the lag when its callback runs.  A busy
+ * event loop delays all timeouts and the random timing is no longer
+ * what the test intends.
+ */
+uint64_t
+lag_deadline(const struct timeval *to)
+{
+	return (monotonic_nsec() + to->tv_sec * 1000000000ULL +
+	    to->tv_usec * 1000ULL);
+}
+
+void
+lag_record(uint64_t deadline)
+{
+	uint64_t	 now;
+
+	now = monotonic_nsec();
+	hist_add(&worker->w_lag, now > deadline ? now - deadline : 0);
+}
+
+void
+lag_init(void)
+{
+	struct timeval	 to;
+
+	evtimer_set(&evlag, lag_callback, &evlag);
+	to.tv_sec = 1;
+	to.tv_usec = 0;
+	evtimer_add(&evlag, &to);
+}
+
+void
+lag_callback(int fd, short event, void *arg)
+{
+	static struct histogram	 last;
+	struct histogram	 lag, dlag;
+	struct timeval		 to;
+	uint64_t		 total, p99;
+
+	/* Warn once per second if the workers cannot keep up. */
+	hist_sum(&lag, offsetof(struct worker, w_lag));
+	hist_delta(&dlag, &lag, &last);
+	last = lag;
+	total = hist_total(&dlag);
+	p99 = hist_percentile(&dlag, total, 99) / 1000;
+	if (p99 > lag_threshold)
+		warnx("event loop lag p99 %lluus exceeds %uus, "
+		    "timeouts are late, add worker threads",
+		    (unsigned long long)p99, lag_threshold);
+
+	to.tv_sec = 1;
+	to.tv_usec = 0;
+	evtimer_add(&evlag, &to);
+}
+
+/*
+ * The cycle counter is cheaper than the clock.  Without time stamp
+ * counter the clock is used directly.  Also used by sudpbench.
+ */
+uint64_t
+prof_cycles(void)
+{
+#if defined(__amd64__) || defined(__i386__)
+	uint32_t	 lo, hi;
+
+	__asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32 | lo);
+#else
+	return (monotonic_nsec());
+#endif
+}
+
+#ifdef PROFILE
+/*
+ * Cycles are converted to nanoseconds with the rate measured since
+ * the program has started.  The report is printed at exit, also when
+ * the program is terminated by a signal.
+ */
+uint64_t		 prof_nsec0, prof_cycles0;
+struct event		 evprofint, evprofterm;
+
+void
+prof_init(void)
+{
+	prof_nsec0 = monotonic_nsec();
+	prof_cycles0 = prof_cycles();
+	signal_set(&evprofint, SIGINT, prof_signal, &evprofint);
+	signal_add(&evprofint, NULL);
+	signal_set(&evprofterm, SIGTERM, prof_signal, &evprofterm);
+	signal_add(&evprofterm, NULL);
+}
+
+void
+prof_signal(int sig, short event, void *arg)
+{
+	prof_print();
+	/* Terminate by the signal like without profiling. */
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+void
+prof_destroy(void)
+{
+	prof_print();
+	signal_del(&evprofint);
+	signal_del(&evprofterm);
+}
+
+void
+prof_leave(struct prof_scope *ps)
+{
+	uint64_t	 cycles;
+
+	cycles = prof_cycles() - ps->ps_begin;
+	worker->w_proftime[ps->ps_func] += cycles;
+	hist_add(&worker->w_prof[ps->ps_func], cycles);
+}
+
+void
+prof_print(void)
+{
+	static const char	*names[prof_nfuncs] = {
+		"socket_start", "socket_callback", "socket_read",
+		"socket_recv", "socket_write", "socket_send", "icmp_send"
+	};
+	struct histogram	 prof;
+	struct worker		*w;
+	uint64_t		 sum, total, cycles;
+	double			 scale;
+	unsigned int		 c, f, n;
+
+	/*
+	 * Print the totals since start, counters of the workers are
+	 * read unlocked.  Times include the profiled callees.
+	 */
+	cycles = prof_cycles() - prof_cycles0;
+	scale = cycles ? (double)(monotonic_nsec() - prof_nsec0) / cycles : 1;
+	fprintf(stderr, "%-16s %10s %10s %8s", "function", "calls",
+	    "total_ms", "avg_ns");
+	for (c = 0; c < STAT_NPCT; c++)
+		fprintf(stderr, " %6s_ns", stat_pctnames[c]);
+	fprintf(stderr, "\n");
+	for (f = 0; f < prof_nfuncs; f++) {
+		memset(&prof, 0, sizeof(prof));
+		sum = 0;
+		for (n = 0, w = workers; n < worker_number; n++, w++) {
+			for (c = 0; c < HIST_BUCKETS; c++)
+				prof.h_count[c] += w->w_prof[f].h_count[c];
+			sum += w->w_proftime[f];
+		}
+		if ((total = hist_total(&prof)) == 0)
+			continue;
+		fprintf(stderr, "%-16s %10llu %10.3f %8.0f", names[f],
+		    (unsigned long long)total, sum * scale / 1e6,
+		    sum * scale / total);
+		for (c = 0; c < STAT_NPCT; c++)
+			fprintf(stderr, " %9.0f", scale *
+			    hist_percentile(&prof, total, stat_pct[c]));
+		fprintf(stderr, "\n");
+	}
+}
+#endif /* PROFILE */
+
+void
+statistic_init(void)
+{
+	/*
+	 * Machine readable statistics must not be mixed with verbose
+	 * output, they go to stderr by default.  The file is opened
+	 * after privileges have been dropped.
+	 */
+	if (stat_file != NULL) {
+		if ((stat_fp = fopen(stat_file, "w")) == NULL)
+			err(1, "fopen %s", stat_file);
+	} else
+		stat_fp = stat_format == format_text ? stdout : stderr;
+
+	signal_set(&evstat, SIGINFO, statistic_callback, &evstat);
+	if (statistics)
+		statistic_callback(SIGINFO, EV_TIMEOUT, &evstat);
+	else
+		signal_add(&evstat, NULL);
+}
+
+void
+statistic_callback(int sig, short event, void *arg)
+{
+	struct event	*evs = arg;
+	static uint64_t	 last[stat_ncounters], lastnsec;
+	static struct histogram	 rtt, lastrtt, drtt, lag, lastlag, dlag;
+	uint64_t	 sum[stat_ncounters], st[stat_ncounters], now;
+	struct worker	*w;
+	unsigned int	 c, n;
+
+	/*
+	 * Counters are only written by their worker thread.  They are
+	 * read unlocked, a slightly stale value is good enough here.
+	 * Report the difference to the previous second.
+	 */
+	now = monotonic_nsec();
+	if (lastnsec == 0)
+		lastnsec = now;
+	memset(sum, 0, sizeof(sum));
+	for (n = 0, w = workers; n < worker_number; n++, w++) {
+		for (c = 0; c < stat_ncounters; c++)
+			sum[c] += w->w_stat[c];
+	}
+	for (c = 0; c < stat_ncounters; c++)
+		st[c] = sum[c] - last[c];
+	if (flow_statistics) {
+		/* Round trip times in this interval. */
+		hist_sum(&rtt, offsetof(struct worker, w_rtt));
+		hist_delta(&drtt, &rtt, &lastrtt);
+	}
+	hist_sum(&lag, offsetof(struct worker, w_lag));
+	hist_delta(&dlag, &lag, &lastlag);
+
+	switch (stat_format) {
+	case format_text:
+		statistic_text(st, sum, &drtt, &dlag, event);
+		break;
+	case format_json:
+		statistic_json(now, now - lastnsec, st, sum, &drtt, &dlag);
+		break;
+	case format_csv:
+		statistic_csv(now, now - lastnsec, st, sum, &drtt, &dlag);
+		break;
+	}
+	fflush(stat_fp);
+#ifdef PROFILE
+	if (event & EV_SIGNAL)
+		prof_print();
+#endif
+
+	if (event & EV_TIMEOUT) {
+		struct timeval	 to;
+
+		to.tv_sec = 1;
+		to.tv_usec = 0;
+		signal_add(evs, &to);
+		memcpy(last, sum, sizeof(last));
+		lastrtt = rtt;
+		lastlag = lag;
+		lastnsec = now;
+	}
+}
+
+void
+statistic_text(const uint64_t *delta, const uint64_t *sum,
+    const struct histogram *drtt, const struct histogram *dlag, short event)
+{
+	uint64_t	 st[stat_ncounters], total;
+	unsigned int	 c;
+	static int	 line;
+
+	/* Open sockets and the pool high water mark are gauges. */
+	memcpy(st, delta, sizeof(st));
+	st[stat_open] = sum[stat_open];
+	st[stat_poolmax] = sum[stat_poolmax];
+	st[stat_cached] = sum[stat_cached];
+
+	if (line-- == 0 || (event & EV_SIGNAL)) {
+		fprintf(stat_fp, " %7s %7s %7s %7s %7s %7s", "open",
+		    "send", "snderr", "recv", "rcverr", "error");
+		if (verbose)
+			fprintf(stat_fp, " %7s %7s", "poolmax", "poolexh");
+		if (icmp_percentage)
+			fprintf(stat_fp, " %7s %7s %7s %7s", "sndicmp",
+			    "rcvicmp", "sndicm6", "rcvicm6");
+		if (mmsg_number > 1)
+			fprintf(stat_fp, " %7s %7s %7s", "rcvmmsg", "occupy%",
+			    "sndsave");
+		if (timer_tick)
+			fprintf(stat_fp, " %7s %7s", "timers", "late_us");
+		if (send_rate)
+			fprintf(stat_fp, " %7s %7s", "short", "sndlate");
+		if (cache_size)
+			fprintf(stat_fp, " %7s %7s %7s %7s", "cached", "hit%",
+			    "evict", "expire");
+		if (recycle_percentage)
+			fprintf(stat_fp, " %7s %7s", "recycle", "churn");
+		if (udp_offload)
+			fprintf(stat_fp, " %7s", "sndgso");
+		if (zerocopy)
+			fprintf(stat_fp, " %7s %7s %7s %7s", "zcsend",
+			    "zcdone", "zccopy", "zcbusy");
+		if (lag_threshold || verbose)
+			fprintf(stat_fp, " %7s %7s", "lag_p99", "lag_max");
+		if (flow_statistics)
+			fprintf(stat_fp,
+			    " %7s %7s %7s %7s %7s %7s %7s %7s %7s %7s",
+			    "lost", "dup", "reorder", "corrupt", "wrongfl",
+			    "p50_us", "p90_us", "p99_us", "p999_us", "max_us");
+		fprintf(stat_fp, "\n");
+		line = 19;
+	}
+	for (c = stat_open; c <= stat_error; c++)
+		fprintf(stat_fp, " %7llu", (unsigned long long)st[c]);
+	if (verbose) {
+		fprintf(stat_fp, " %7llu %7llu",
+		    (unsigned long long)st[stat_poolmax],
+		    (unsigned long long)st[stat_poolfail]);
+	}
+	if (icmp_percentage) {
+		fprintf(stat_fp, " %7llu %7llu %7llu %7llu",
+		    (unsigned long long)st[stat_sndicmp],
+		    (unsigned long long)st[stat_rcvicmp],
+		    (unsigned long long)st[stat_sndicmp6],
+		    (unsigned long long)st[stat_rcvicmp6]);
+	}
+	if (mmsg_number > 1) {
+		/* Percentage of the recvmmsg vector that has been filled. */
+		fprintf(stat_fp, " %7llu %7llu %7llu",
+		    (unsigned long long)st[stat_rcvmmsg],
+		    st[stat_rcvmmsg] ? (unsigned long long)(100 *
+		    st[stat_rcvbatch] / (st[stat_rcvmmsg] * mmsg_number)) : 0,
+		    (unsigned long long)st[stat_sndsave]);
+	}
+	if (timer_tick) {
+		/* Average lateness of the expired timers. */
+		fprintf(stat_fp, " %7llu %7llu",
+		    (unsigned long long)st[stat_tmfire],
+		    st[stat_tmfire] ? (unsigned long long)
+		    (st[stat_tmlate] / st[stat_tmfire]) : 0);
+	}
+	if (send_rate) {
+		fprintf(stat_fp, " %7llu %7llu",
+		    (unsigned long long)st[stat_shortfall],
+		    (unsigned long long)st[stat_sndlate]);
+	}
+	if (cache_size) {
+		uint64_t	 lookup;
+
+		/* Percentage of connected socket lookups that hit. */
+		lookup = st[stat_cachehit] + st[stat_cachemiss];
+		fprintf(stat_fp, " %7llu %7llu %7llu %7llu",
+		    (unsigned long long)st[stat_cached],
+		    lookup ? (unsigned long long)(100 * st[stat_cachehit] /
+		    lookup) : 0,
+		    (unsigned long long)st[stat_cacheevict],
+		    (unsigned long long)st[stat_cacheexpire]);
+	}
+	if (recycle_percentage) {
+		fprintf(stat_fp, " %7llu %7llu",
+		    (unsigned long long)st[stat_recycle],
+		    (unsigned long long)st[stat_churn]);
+	}
+	if (udp_offload) {
+		fprintf(stat_fp, " %7llu",
+		    (unsigned long long)st[stat_sndgso]);
+	}
+	if (zerocopy) {
+		fprintf(stat_fp, " %7llu %7llu %7llu %7llu",
+		    (unsigned long long)st[stat_zcsend],
+		    (unsigned long long)st[stat_zcdone],
+		    (unsigned long long)st[stat_zccopied],
+		    (unsigned long long)st[stat_zcbusy]);
+	}
+	if (lag_threshold || verbose) {
+		/* How late the timeouts have fired in microseconds. */
+		total = hist_total(dlag);
+		fprintf(stat_fp, " %7llu %7llu", (unsigned long long)
+		    (hist_percentile(dlag, total, 99) / 1000),
+		    (unsigned long long)
+		    (hist_percentile(dlag, total, 100) / 1000));
+	}
+	if (flow_statistics) {
+		for (c = stat_lost; c <= stat_wrongflow; c++)
+			fprintf(stat_fp, " %7llu", (unsigned long long)st[c]);
+		total = hist_total(drtt);
+		for (c = 0; c < STAT_NPCT; c++)
+			fprintf(stat_fp, " %7llu", (unsigned long long)
+			    (hist_percentile(drtt, total, stat_pct[c]) / 1000));
+	}
+	fprintf(stat_fp, "\n");
+}
+
+/*
+ * Per second rate of a counter difference over an interval given in
+ * nanoseconds.
+ */
+double
+statistic_rate(uint64_t delta, uint64_t nsec)
+{
+	return (nsec ? delta * 1e9 / nsec : 0.0);
+}
+
+/*
+ * Cpu time of all threads of the process in microseconds, so that
+ * the cost per packet can be calculated.
+ */
+void
+statistic_rusage(uint64_t *user, uint64_t *sys)
+{
+	struct rusage	 ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		err(1, "getrusage");
+	*user = ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec;
+	*sys = ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+}
+
+void
+statistic_json(uint64_t now, uint64_t nsec, const uint64_t *delta,
+    const uint64_t *sum, const struct histogram *drtt,
+    const struct histogram *dlag)
+{
+	uint64_t	 total, user, sys;
+	unsigned int	 c;
+
+	/*
+	 * The differences of the gauges open and poolmax may be
+	 * negative, print all deltas signed.
+	 */
+	statistic_rusage(&user, &sys);
+	fprintf(stat_fp, "{\"time_ns\":%llu,\"interval_ns\":%llu,"
+	    "\"cpu_user_us\":%llu,\"cpu_sys_us\":%llu,\"delta\":{",
+	    (unsigned long long)now, (unsigned long long)nsec,
+	    (unsigned long long)user, (unsigned long long)sys);
+	for (c = 0; c < stat_ncounters; c++)
+		fprintf(stat_fp, "%s\"%s\":%lld", c ? "," : "", stat_names[c],
+		    (long long)delta[c]);
+	fprintf(stat_fp, "},\"total\":{");
+	for (c = 0; c < stat_ncounters; c++)
+		fprintf(stat_fp, "%s\"%s\":%llu", c ? "," : "", stat_names[c],
+		    (unsigned long long)sum[c]);
+	fprintf(stat_fp, "},\"rate\":{\"send_pps\":%.1f,\"recv_pps\":%.1f,"
+	    "\"send_bytes_per_sec\":%.1f,\"recv_bytes_per_sec\":%.1f}",
+	    statistic_rate(delta[stat_send], nsec),
+	    statistic_rate(delta[stat_recv], nsec),
+	    statistic_rate(delta[stat_sndbytes], nsec),
+	    statistic_rate(delta[stat_rcvbytes], nsec));
+	if (flow_statistics) {
+		total = hist_total(drtt);
+		fprintf(stat_fp, ",\"rtt_us\":{");
+		for (c = 0; c < STAT_NPCT; c++)
+			fprintf(stat_fp, "%s\"%s\":%llu", c ? "," : "",
+			    stat_pctnames[c], (unsigned long long)
+			    (hist_percentile(drtt, total, stat_pct[c]) / 1000));
+		fprintf(stat_fp, "}");
+	}
+	total = hist_total(dlag);
+	fprintf(stat_fp, ",\"lag_us\":{");
+	for (c = 0; c < STAT_NPCT; c++)
+		fprintf(stat_fp, "%s\"%s\":%llu", c ? "," : "",
+		    stat_pctnames[c], (unsigned long long)
+		    (hist_percentile(dlag, total, stat_pct[c]) / 1000));
+	fprintf(stat_fp, "}}\n");
+}
+
+void
+statistic_csv(uint64_t now, uint64_t nsec, const uint64_t *delta,
+    const uint64_t *sum, const struct histogram *drtt,
+    const struct histogram *dlag)
+{
+	uint64_t	 total, user, sys;
+	unsigned int	 c;
+	static int	 header;
+
+	/* The columns do not change during a run, print the header once. */
+	if (!header) {
+		fprintf(stat_fp, "time_ns,interval_ns,cpu_user_us,cpu_sys_us");
+		for (c = 0; c < stat_ncounters; c++)
+			fprintf(stat_fp, ",%s", stat_names[c]);
+		for (c = 0; c < stat_ncounters; c++)
+			fprintf(stat_fp, ",%s_total", stat_names[c]);
+		fprintf(stat_fp, ",send_pps,recv_pps"
+		    ",send_bytes_per_sec,recv_bytes_per_sec");
+		if (flow_statistics) {
+			for (c = 0; c < STAT_NPCT; c++)
+				fprintf(stat_fp, ",rtt_%s_us",
+				    stat_pctnames[c]);
+		}
+		for (c = 0; c < STAT_NPCT; c++)
+			fprintf(stat_fp, ",lag_%s_us", stat_pctnames[c]);
+		fprintf(stat_fp, "\n");
+		header = 1;
+	}
+	statistic_rusage(&user, &sys);
+	fprintf(stat_fp, "%llu,%llu,%llu,%llu", (unsigned long long)now,
+	    (unsigned long long)nsec, (unsigned long long)user,
+	    (unsigned long long)sys);
+	for (c = 0; c < stat_ncounters; c++)
+		fprintf(stat_fp, ",%lld", (long long)delta[c]);
+	for (c = 0; c < stat_ncounters; c++)
+		fprintf(stat_fp, ",%llu", (unsigned long long)sum[c]);
+	fprintf(stat_fp, ",%.1f,%.1f,%.1f,%.1f",
+	    statistic_rate(delta[stat_send], nsec),
+	    statistic_rate(delta[stat_recv], nsec),
+	    statistic_rate(delta[stat_sndbytes], nsec),
+	    statistic_rate(delta[stat_rcvbytes], nsec));
+	if (flow_statistics) {
+		total = hist_total(drtt);
+		for (c = 0; c < STAT_NPCT; c++)
+			fprintf(stat_fp, ",%llu", (unsigned long long)
+			    (hist_percentile(drtt, total, stat_pct[c]) / 1000));
+	}
+	total = hist_total(dlag);
+	for (c = 0; c < STAT_NPCT; c++)
+		fprintf(stat_fp, ",%llu", (unsigned long long)
+		    (hist_percentile(dlag, total, stat_pct[c]) / 1000));
+	fprintf(stat_fp, "\n");
+}
+
+void
+shm_init(void)
+{
+	int	 fd;
+
+	if ((fd = open(shm_file, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+		err(1, "open %s", shm_file);
+	if (ftruncate(fd, sizeof(*shm)) == -1)
+		err(1, "ftruncate %s", shm_file);
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+	if (shm == MAP_FAILED)
+		err(1, "mmap %s", shm_file);
+	if (close(fd) == -1)
+		err(1, "close");
+
+	shm->sh_magic = SHM_MAGIC;
+	shm->sh_version = SHM_VERSION;
+	shm->sh_ncounters = stat_ncounters;
+	shm->sh_nbuckets = HIST_BUCKETS;
+	evtimer_set(&evshm, shm_callback, &evshm);
+	shm_callback(-1, EV_TIMEOUT, &evshm);
+}
+
+void
+shm_callback(int fd, short event, void *arg)
+{
+	struct event	*evs = arg;
+	struct worker	*w;
+	unsigned int	 c, n;
+
+	/*
+	 * Writers are serialized as only the main thread updates the
+	 * segment.  Mark it as inconsistent while the sums are copied.
+	 */
+	shm->sh_seq++;
+	__sync_synchronize();
+	memset(shm->sh_stat, 0, sizeof(shm->sh_stat));
+	for (n = 0, w = workers; n < worker_number; n++, w++) {
+		for (c = 0; c < stat_ncounters; c++)
+			shm->sh_stat[c] += w->w_stat[c];
+	}
+	if (flow_statistics)
+		hist_sum(&shm->sh_rtt, offsetof(struct worker, w_rtt));
+	shm->sh_time = monotonic_nsec();
+	__sync_synchronize();
+	shm->sh_seq++;
+
+	if (event & EV_TIMEOUT) {
+		struct timeval	 to;
+
+		to.tv_sec = 0;
+		to.tv_usec = SHM_INTERVAL;
+		evtimer_add(evs, &to);
+	}
+}
+
+void
+shm_destroy(void)
+{
+	/* Publish the final values, the file stays for the reader. */
+	shm_callback(-1, 0, &evshm);
+	evtimer_del(&evshm);
+	if (munmap(shm, sizeof(*shm)) == -1)
+		err(1, "munmap %s", shm_file);
+}
+
 void
 statistic_destroy(void)
 {
 	if (statistics)
 		statistic_callback(SIGINFO, 0, &evstat);
 	event_del(&evstat);
+	if (stat_file != NULL && fclose(stat_fp) == EOF)
+		err(1, "fclose %s", stat_file);
 }
@@ -17,24 +17,391 @@
 #ifndef SLOWUDP_UTIL_H
 #define SLOWUDP_UTIL_H
 
+#define CACHELINE_SIZE	64
+
+enum stat_counters {
+	stat_open,		/* currently open sockets */
+	stat_send,		/* packets sent */
+	stat_snderr,		/* send errors */
+	stat_recv,		/* packets received */
+	stat_rcverr,		/* receive errors */
+	stat_error,		/* other errors */
+	stat_sndicmp,		/* icmp errors sent */
+	stat_rcvicmp,		/* icmp packets received */
+	stat_sndicmp6,		/* icmp6 errors sent */
+	stat_rcvicmp6,		/* icmp6 errors received */
+	stat_rcvmmsg,		/* recvmmsg system calls */
+	stat_rcvbatch,		/* packets received with recvmmsg */
+	stat_sndsave,		/* system calls saved by sendmmsg */
+	stat_poolmax,		/* high water mark of pool items */
+	stat_poolfail,		/* pool exhausted, fallback to malloc */
+	stat_tmfire,		/* timer wheel timeouts */
+	stat_tmlate,		/* timeout lateness in microseconds */
+	stat_lost,		/* queries without response after wait time */
+	stat_dup,		/* duplicate responses */
+	stat_reorder,		/* responses received out of order */
+	stat_corrupt,		/* responses with bad length or checksum */
+	stat_wrongflow,		/* responses for another flow */
+	stat_shortfall,		/* open loop queries not sent */
+	stat_sndlate,		/* open loop queries sent after deadline */
+	stat_sndbytes,		/* udp payload bytes sent */
+	stat_rcvbytes,		/* udp payload bytes read from the socket */
+	stat_cached,		/* idle connected sockets in the cache */
+	stat_cachehit,		/* queries on a cached socket */
+	stat_cachemiss,		/* queries on a new connected socket */
+	stat_cacheevict,	/* idle sockets evicted from a full cache */
+	stat_cacheexpire,	/* idle sockets closed after linger time */
+	stat_recycle,		/* flows restarted on their old socket */
+	stat_churn,		/* flows restarted on a new socket */
+	stat_sndgso,		/* sends segmented by the kernel */
+	stat_zcsend,		/* sends with MSG_ZEROCOPY */
+	stat_zcdone,		/* zero copy buffers released */
+	stat_zccopied,		/* zero copy sends copied by kernel */
+	stat_zcbusy,		/* no free zero copy buffer, copied send */
+	stat_ncounters
+};
+
+/* Output formats of the statistics. */
+enum stat_format {
+	format_text,		/* human readable columns */
+	format_json,		/* one json object per line */
+	format_csv,		/* comma separated values with header */
+};
+
+/*
+ * Fixed size pool of cache line aligned items with a free list.
+ * It belongs to a single worker thread and needs no locking.
+ */
+struct pool {
+	char		*pl_base;
+	void		*pl_free;
+	size_t		 pl_size;
+	unsigned int	 pl_count;
+	unsigned int	 pl_inuse;
+};
+
+/*
+ * Timeout on the hierarchical timer wheel of a worker.  When it
+ * expires, the callback is called like a libevent timeout.
+ */
+TAILQ_HEAD(timer_list, timer);
+struct timer {
+	TAILQ_ENTRY(timer)	 tm_entry;
+	struct timer_list	*tm_list;
+	void			(*tm_func)(int, short, void *);
+	void			*tm_arg;
+	uint64_t		 tm_expire;	/* wheel tick */
+	uint64_t		 tm_deadline;	/* monotonic nanoseconds */
+	int			 tm_fd;
+};
+
+/*
+ * Header at the beginning of every query.  The server echoes it
+ * unmodified in the response.  The client validates the checksum
+ * and matches flow and sequence number.
+ */
+struct payload_header {
+	uint32_t		 ph_flow;	/* flow identifier */
+	uint32_t		 ph_seq;	/* query number of the flow */
+	uint64_t		 ph_time;	/* monotonic nanoseconds */
+	uint16_t		 ph_cksum;	/* of the fields above */
+	uint16_t		 ph_pad[3];
+};
+
+/* Internet checksum implementation, cpu feature needed to run it. */
+struct cksum_method {
+	const char	*cm_name;
+	const char	*cm_cpu;
+	int		(*cm_func)(const void *, size_t);
+};
+
+/*
+ * An icmp error quotes the ip and udp header of the packet and some
+ * bytes of the payload.  Errors are sent in batches.
+ */
+#define ICMP_HDRLEN	(ICMP_MINLEN + sizeof(struct ip) + \
+			    sizeof(struct udphdr))
+#define ICMP6_HDRLEN	(sizeof(struct icmp6_hdr) + \
+			    sizeof(struct ip6_hdr) + sizeof(struct udphdr))
+#define ICMP_QUOTEMAX	1024
+#define ICMP_PACKETMAX	(ICMP6_HDRLEN + ICMP_QUOTEMAX)
+#define ICMP_BATCH	32
+
+/*
+ * A train is a sequence of datagrams with the same length to the
+ * same peer.  With UDP_SEGMENT the kernel splits a single send into
+ * the datagrams.  The sum of their lengths must fit into one IP
+ * packet.
+ */
+#define TRAIN_MAX	64
+#define TRAIN_MAXBYTES	65507
+
+/* Received payload is discarded, the buffer fits any udp datagram. */
+#define RECV_BUFSIZE	65536
+
+/*
+ * Random times are drawn in microseconds up to a bound from one of
+ * these distributions.  Exponential and Pareto use a table of the
+ * inverse cumulative distribution function, empirical times from a
+ * file an alias table.
+ */
+enum dist_type {
+	dist_uniform,
+	dist_exponential,
+	dist_pareto,
+	dist_fixed,
+	dist_empirical
+};
+
+#define TIME_MAX		60000000	/* one minute in microseconds */
+#define DIST_OCTAVES		32
+#define DIST_STEPBITS		6
+#define DIST_STEPS		(1 << DIST_STEPBITS)
+#define DIST_TABLE		(DIST_OCTAVES * (DIST_STEPS + 1))
+#define DIST_EMPIRICALMAX	1000000
+
+struct distribution {
+	enum dist_type		 d_type;
+	uint32_t		 d_bound;	/* maximum in microseconds */
+	uint32_t		*d_table;	/* DIST_TABLE quantiles */
+	uint32_t		*d_value;	/* empirical times */
+	uint32_t		*d_alias;	/* other value of the slot */
+	uint64_t		*d_prob;	/* own value, scaled by 2^32 */
+	uint32_t		 d_count;
+};
+
+/*
+ * Buffers for MSG_ZEROCOPY belong to the kernel until it has
+ * reported their completion on the error queue of the socket.  They
+ * are numbered per socket in send order.  Copying is cheaper for
+ * small packets.  A closed socket lingers until its buffers are
+ * released.
+ */
+#define ZEROCOPY_BUFFERS	256
+#define ZEROCOPY_MINLEN		8192
+#define ZEROCOPY_REAP		1000		/* linger check in us */
+#define ZEROCOPY_LINGER		1000000000ULL	/* give up after 1 s */
+
+struct zc_buffer {
+	TAILQ_ENTRY(zc_buffer)	 zb_entry;
+	uint32_t		 zb_seq;
+	char			*zb_data;
+};
+TAILQ_HEAD(zc_list, zc_buffer);
+
+#define HIST_SUBBITS	5
+#define HIST_SUBCOUNT	(1 << HIST_SUBBITS)
+#define HIST_BUCKETS	((64 - HIST_SUBBITS + 1) * HIST_SUBCOUNT)
+
+struct histogram {
+	uint64_t		 h_count[HIST_BUCKETS];
+};
+
+/*
+ * Profiling of the hot path is compiled in with -DPROFILE.  The
+ * run time of a function including its callees is measured from
+ * PROFILE_SCOPE() until it returns, the cleanup attribute catches
+ * every return.  Put it after the local declarations.  Without
+ * -DPROFILE nothing remains.
+ */
+#ifdef PROFILE
+enum prof_func {
+	prof_start,
+	prof_callback,
+	prof_read,
+	prof_recv,
+	prof_write,
+	prof_send,
+	prof_icmp,
+	prof_nfuncs
+};
+
+struct prof_scope {
+	uint64_t		 ps_begin;	/* cycle counter */
+	enum prof_func		 ps_func;
+};
+
+#define PROFILE_SCOPE(f)						\
+	struct prof_scope prof_scope					\
+	    __attribute__((__cleanup__(prof_leave))) = { prof_cycles(), (f) }
+#else
+#define PROFILE_SCOPE(f)	do { } while (0)
+#endif
+
+/*
+ * Every worker thread runs its own event loop.  The statistic
+ * counters are only written by the thread that owns them, so they
+ * need no locking on the hot path.
+ */
+struct worker {
+	uint64_t		 w_stat[stat_ncounters];
+	struct event_base	*w_base;
+	pthread_t		 w_thread;
+	unsigned int		 w_id;
+	unsigned int		 w_sockets;
+	struct pool		 w_pool;
+	struct histogram	 w_rtt;
+	struct histogram	 w_lag;		/* late timeouts */
+#ifdef PROFILE
+	struct histogram	 w_prof[prof_nfuncs];
+	uint64_t		 w_proftime[prof_nfuncs];
+#endif
+	uint64_t		 w_random[4];
+} __aligned(CACHELINE_SIZE);
+
+/*
+ * Statistics exported in a shared memory file.  The main thread
+ * publishes the sum of all workers periodically.  The sequence number
+ * is odd while the segment is written, a reader retries if it has
+ * changed during its copy.  Readers never block the event loop.
+ */
+#define SHM_MAGIC	0x73756470	/* "sudp" */
+#define SHM_VERSION	1
+#define SHM_INTERVAL	10000		/* update period in us */
+
+struct stat_shm {
+	uint32_t		 sh_magic;
+	uint32_t		 sh_version;
+	uint32_t		 sh_ncounters;
+	uint32_t		 sh_nbuckets;
+	volatile uint64_t	 sh_seq;
+	uint64_t		 sh_time;	/* monotonic nsec of update */
+	uint64_t		 sh_stat[stat_ncounters];
+	struct histogram	 sh_rtt;
+};
+
 void	 usage(void);
 void	 setopt(int, char **);
+void	 cksum_init(void);
+int	 cksum_supported(const struct cksum_method *);
+int	 in_cksum(const void *, size_t);
+int	 in_cksum_scalar(const void *, size_t);
+void	 icmp_typecode(const char *);
+void	 icmp_template(void);
 void	 icmp_init(void);
-void	 icmp_send(struct sockaddr_in *, socklen_t,
-	    struct sockaddr_in *, socklen_t);
+size_t	 icmp_build(char *, const struct sockaddr_in *,
+	    const struct sockaddr_in *);
+size_t	 icmp6_build(char *, const struct sockaddr_in6 *,
+	    const struct sockaddr_in6 *);
+void	 icmp_send(struct sockaddr *, socklen_t, struct sockaddr *,
+	    socklen_t);
 void	 icmp_destroy(void);
 void	 socket_init(void);
-void	 socket_send(int, const char *, struct sockaddr *, size_t);
+void	 socket_worker(void);
+size_t	 socket_payload(size_t);
+void	 socket_rcviov(struct iovec *, void *, size_t);
+void	 socket_send(int, const void *, size_t, struct sockaddr *, size_t);
+void	 socket_train(int, const struct payload_header *, unsigned int,
+	    struct sockaddr *, size_t);
+void	 zerocopy_init(void);
+void	 zerocopy_socket(int);
+void	 zerocopy_send(int, const void *, size_t, struct sockaddr *,
+	    size_t);
+void	 zerocopy_reap(int);
+void	 zerocopy_close(int);
+void	 zerocopy_linger(int, short, void *);
+void	 socket_enqueue(int, const void *, size_t, struct sockaddr *,
+	    size_t);
+void	 worker_done(void);
+uint64_t monotonic_nsec(void);
+unsigned int hist_index(uint64_t);
+uint64_t hist_value(unsigned int);
+void	 hist_add(struct histogram *, uint64_t);
+uint64_t hist_total(const struct histogram *);
+uint64_t hist_percentile(const struct histogram *, uint64_t, double);
+void	 hist_sum(struct histogram *, size_t);
+void	 hist_delta(struct histogram *, const struct histogram *,
+	    const struct histogram *);
+void	 timer_init(void);
+void	 timer_destroy(void);
+void	 timer_set(struct timer *, int, void (*)(int, short, void *),
+	    void *);
+void	 timer_add(struct timer *, const struct timeval *);
+void	 timer_del(struct timer *);
+void	 random_init(struct worker *);
+uint64_t random_next(void);
+uint32_t random_uniform(uint32_t);
+uint32_t time_parse(const char *, const char *);
+void	 dist_parse(const char *);
+void	 dist_init(struct distribution *, uint32_t);
+uint32_t dist_sample(const struct distribution *);
+void	 dist_timeval(const struct distribution *, struct timeval *);
+uint64_t lag_deadline(const struct timeval *);
+void	 lag_record(uint64_t);
+uint64_t prof_cycles(void);
+#ifdef PROFILE
+void	 prof_init(void);
+void	 prof_signal(int, short, void *);
+void	 prof_destroy(void);
+void	 prof_leave(struct prof_scope *);
+void	 prof_print(void);
+#endif
+void	 pool_init(struct pool *, size_t, unsigned int);
+void	*pool_get(struct pool *);
+void	 pool_put(struct pool *, void *);
+void	 event_method(const char *);
+enum stat_format statistic_format(const char *);
 void	 statistic_init(void);
+void	 statistic_callback(int, short, void *);
 void	 statistic_destroy(void);
+void	 shm_init(void);
+void	 shm_destroy(void);
 
 extern int		 sicmp;
 extern unsigned int	 icmp_percentage;
+extern unsigned int	 icmp_type;
+extern unsigned int	 icmp_code;
+extern unsigned int	 icmp_quote;
 extern unsigned int	 socket_number;
 extern unsigned int	 payload_bound;
+extern unsigned int	 mmsg_number;
+extern unsigned int	 worker_number;
+extern unsigned int	 timer_tick;
+extern unsigned int	 send_rate;
+extern unsigned int	 cache_size;
+extern unsigned int	 recycle_percentage;
+extern uint32_t		 lag_threshold;
+extern int		 udp_offload;
+extern int		 zerocopy;
+extern enum stat_format	 stat_format;
+extern const char	*stat_file;
+extern FILE		*stat_fp;
+extern const char	*stat_names[stat_ncounters];
+extern const char	*shm_file;
+extern const char	*method_name;
+extern uint64_t		 random_seed;
+extern enum dist_type	 dist_type;
+extern int		 random_seeded;
 extern int		 statistics;
-extern unsigned int	 stat_open, stat_send, stat_snderr,
-			 stat_recv, stat_rcverr, stat_error,
-			 stat_sndicmp, stat_rcvicmp;
+extern int		 verbose;
+extern int		 flow_statistics;
+extern const struct cksum_method cksum_methods[];
+extern const struct cksum_method *cksum_method;
+extern struct worker	*workers;
+extern __thread struct worker	*worker;
+
+static inline void
+stat_inc(enum stat_counters c)
+{
+	worker->w_stat[c]++;
+}
+
+static inline void
+stat_dec(enum stat_counters c)
+{
+	worker->w_stat[c]--;
+}
+
+static inline void
+stat_add(enum stat_counters c, uint64_t v)
+{
+	worker->w_stat[c] += v;
+}
+
+static inline uint64_t
+stat_get(enum stat_counters c)
+{
+	return (worker->w_stat[c]);
+}
 
 #endif /* SLOWUDP_UTIL_H */